@@ -0,0 +1,392 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "lisp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * Parse cache for `load`.
+ *
+ * The forms read from a file are kept in memory keyed on its path, and
+ * reused for as long as the file's size and modification time stay the
+ * same, so loading it again skips the reader entirely. The
+ * cached lists are shared copy-on-write like any other value, and
+ * whatever the evaluator attaches to them (resolved slots, bytecode)
+ * carries over to the next load.
+ *
+ * With a cache directory set (`--parse-cache=DIR`) the forms are also
+ * written to DIR in a small binary format and read back by later
+ * processes. A disk entry also records a hash of the file contents,
+ * which is checked before the entry is used, and ends with a hash of
+ * its own payload, so a damaged entry is reparsed instead of run.
+ */
+typedef struct lcache {
+    char *path;
+    long long mtime_sec;
+    long long mtime_nsec;
+    long long size;
+    lval *forms;
+} lcache;
+
+char *lcache_dir;
+
+static lcache *lcache_entries;
+static size_t lcache_count;
+
+/* hash of the payload bytes written or read so far */
+static unsigned long long lcache_sum;
+
+#define LCACHE_MAGIC "LPC2"
+#define LCACHE_HASH_INIT 14695981039346656037ull
+
+/* st_mtim is POSIX 2008; macOS spells it st_mtimespec */
+#if defined(__APPLE__)
+#define LCACHE_MTIME_NSEC(st) ((long long)(st)->st_mtimespec.tv_nsec)
+#elif defined(_WIN32)
+#define LCACHE_MTIME_NSEC(st) 0ll
+#else
+#define LCACHE_MTIME_NSEC(st) ((long long)(st)->st_mtim.tv_nsec)
+#endif
+
+/* FNV-1a, 64 bit, continuing from h */
+static unsigned long long lcache_hash(unsigned long long h, const char *s,
+                                      size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
+    }
+
+    return h;
+}
+
+static lcache *lcache_find(char *path)
+{
+    for (size_t i = 0; i < lcache_count; i++) {
+        if (strcmp(lcache_entries[i].path, path) == 0) {
+            return &lcache_entries[i];
+        }
+    }
+    return NULL;
+}
+
+/* Disk format: one tag byte per value, then its payload */
+
+static void lcache_put(FILE *f, const void *p, size_t n)
+{
+    lcache_sum = lcache_hash(lcache_sum, p, n);
+    fwrite(p, 1, n, f);
+}
+
+static int lcache_get(FILE *f, void *p, size_t n)
+{
+    if (fread(p, 1, n, f) != n) {
+        return 0;
+    }
+    lcache_sum = lcache_hash(lcache_sum, p, n);
+    return 1;
+}
+
+static void lcache_write_u64(FILE *f, unsigned long long x)
+{
+    lcache_put(f, &x, sizeof(x));
+}
+
+static void lcache_write_str(FILE *f, char *s)
+{
+    lcache_write_u64(f, strlen(s));
+    lcache_put(f, s, strlen(s));
+}
+
+static void lcache_write(FILE *f, lval *v)
+{
+    unsigned char t = (unsigned char)LVAL_TYPE(v);
+
+    lcache_put(f, &t, 1);
+
+    switch (t) {
+    case LVAL_NUM:
+        lcache_write_u64(f, (unsigned long long)LVAL_NUMVAL(v));
+        break;
+    case LVAL_ERR:
+        lcache_write_str(f, v->err);
+        break;
+    case LVAL_SYM:
+        lcache_write_str(f, v->sym);
+        break;
+    case LVAL_STR:
+        lcache_write_str(f, v->str);
+        break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+        lcache_write_u64(f, v->count);
+        for (size_t i = 0; i < v->count; i++) {
+            lcache_write(f, v->cell[i]);
+        }
+        break;
+    }
+}
+
+static int lcache_read_u64(FILE *f, unsigned long long *x)
+{
+    return lcache_get(f, x, sizeof(*x));
+}
+
+static char *lcache_read_str(FILE *f)
+{
+    unsigned long long n;
+    char *s;
+
+    if (!lcache_read_u64(f, &n) || n > (1ull << 32)) {
+        return NULL;
+    }
+
+    s = malloc(n + 1);
+    if (!lcache_get(f, s, n)) {
+        free(s);
+        return NULL;
+    }
+    s[n] = '\0';
+
+    return s;
+}
+
+/* Returns NULL if the entry is truncated or corrupt */
+static lval *lcache_read(FILE *f)
+{
+    unsigned char t;
+    unsigned long long n;
+    char *s;
+    lval *v;
+
+    if (!lcache_get(f, &t, 1)) {
+        return NULL;
+    }
+
+    switch (t) {
+    case LVAL_NUM:
+        if (!lcache_read_u64(f, &n)) {
+            return NULL;
+        }
+        return lval_num((long)n);
+    case LVAL_ERR:
+    case LVAL_SYM:
+    case LVAL_STR:
+        s = lcache_read_str(f);
+        if (!s) {
+            return NULL;
+        }
+        v = t == LVAL_ERR ? lval_err("%s", s)
+            : t == LVAL_SYM ? lval_sym(s) : lval_str(s);
+        free(s);
+        return v;
+    case LVAL_SEXPR:
+        v = lval_sexpr();
+        break;
+    case LVAL_QEXPR:
+        v = lval_qexpr();
+        break;
+    default:
+        return NULL;
+    }
+
+    if (!lcache_read_u64(f, &n)) {
+        lval_delete(v);
+        return NULL;
+    }
+
+    for (; n > 0; n--) {
+        lval *x = lcache_read(f);
+        if (!x) {
+            lval_delete(v);
+            return NULL;
+        }
+        v = lval_add(v, x);
+    }
+
+    return v;
+}
+
+/* DIR/<hash of path>.lpc */
+static char *lcache_disk_path(char *path)
+{
+    size_t n = strlen(lcache_dir) + 32;
+    char *name = malloc(n);
+
+    snprintf(name, n, "%s/%016llx.lpc", lcache_dir,
+             lcache_hash(LCACHE_HASH_INIT, path, strlen(path)));
+
+    return name;
+}
+
+static lval *lcache_disk_get(char *path, struct stat *st,
+                             unsigned long long hash)
+{
+    char *name = lcache_disk_path(path);
+    FILE *f = fopen(name, "rb");
+    unsigned long long key[4];
+    unsigned long long sum;
+    char magic[4];
+    lval *forms = NULL;
+
+    free(name);
+    if (!f) {
+        return NULL;
+    }
+
+    if (fread(magic, 1, 4, f) == 4 && memcmp(magic, LCACHE_MAGIC, 4) == 0 &&
+        fread(key, sizeof(key), 1, f) == 1 &&
+        key[0] == (unsigned long long)st->st_mtime &&
+        key[1] == (unsigned long long)LCACHE_MTIME_NSEC(st) &&
+        key[2] == (unsigned long long)st->st_size && key[3] == hash) {
+        lcache_sum = LCACHE_HASH_INIT;
+        forms = lcache_read(f);
+
+        /* the payload must hash to the sum written after it */
+        if (forms && (fread(&sum, sizeof(sum), 1, f) != 1 ||
+                      sum != lcache_sum)) {
+            lval_delete(forms);
+            forms = NULL;
+        }
+    }
+
+    fclose(f);
+
+    return forms;
+}
+
+static void lcache_disk_put(char *path, struct stat *st,
+                            unsigned long long hash, lval *forms)
+{
+    char *name = lcache_disk_path(path);
+    size_t n = strlen(name) + 5;
+    char *tmp = malloc(n);
+    unsigned long long sum;
+    FILE *f;
+
+    /* write aside and rename, so readers never see half an entry */
+    snprintf(tmp, n, "%s.tmp", name);
+    f = fopen(tmp, "wb");
+
+    if (f) {
+        fwrite(LCACHE_MAGIC, 1, 4, f);
+        lcache_write_u64(f, (unsigned long long)st->st_mtime);
+        lcache_write_u64(f, (unsigned long long)LCACHE_MTIME_NSEC(st));
+        lcache_write_u64(f, (unsigned long long)st->st_size);
+        lcache_write_u64(f, hash);
+
+        lcache_sum = LCACHE_HASH_INIT;
+        lcache_write(f, forms);
+        sum = lcache_sum;
+        fwrite(&sum, sizeof(sum), 1, f);
+
+        if (fclose(f) == 0) {
+            rename(tmp, name);
+        } else {
+            remove(tmp);
+        }
+    }
+
+    free(tmp);
+    free(name);
+}
+
+/*
+ * Returns the forms in the file at path as an S-expression (shared with
+ * the cache), or an error if it can't be read or parsed.
+ */
+lval *lcache_load(char *path)
+{
+    struct stat st;
+    lcache *c;
+    char *src;
+    size_t len;
+    unsigned long long hash;
+    lval *forms = NULL;
+
+    if (stat(path, &st) != 0) {
+        return lval_err("Could not load library %s: error: "
+                        "Unable to open file!", path);
+    }
+
+    /* an unchanged file is never read again */
+    c = lcache_find(path);
+    if (c && c->mtime_sec == (long long)st.st_mtime &&
+        c->mtime_nsec == LCACHE_MTIME_NSEC(&st) &&
+        c->size == (long long)st.st_size) {
+        lisp_stats.load_hits++;
+        return lval_retain(c->forms);
+    }
+
+    src = lread_file(path, &len);
+    if (!src) {
+        return lval_err("Could not load library %s: error: "
+                        "Unable to open file!", path);
+    }
+
+    hash = lcache_hash(LCACHE_HASH_INIT, src, len);
+    if (lcache_dir) {
+        forms = lcache_disk_get(path, &st, hash);
+    }
+
+    if (forms) {
+        lisp_stats.load_hits++;
+    } else {
+        forms = lisp_reader == LREADER_MPC ? lread_mpc(path, src)
+                                           : lread(path, src);
+        if (LVAL_TYPE(forms) == LVAL_ERR) {
+            lval *err = lval_err("Could not load library %s", forms->err);
+
+            lval_delete(forms);
+            free(src);
+
+            return err;
+        }
+
+        lisp_stats.load_parses++;
+        if (lcache_dir) {
+            lcache_disk_put(path, &st, hash, forms);
+        }
+    }
+    free(src);
+
+    c = lcache_find(path);
+    if (!c) {
+        lcache_entries = realloc(lcache_entries,
+                                 sizeof(lcache) * (lcache_count + 1));
+        c = &lcache_entries[lcache_count++];
+        c->path = malloc(strlen(path) + 1);
+        strcpy(c->path, path);
+    } else {
+        lval_delete(c->forms);
+    }
+
+    c->mtime_sec = (long long)st.st_mtime;
+    c->mtime_nsec = LCACHE_MTIME_NSEC(&st);
+    c->size = (long long)st.st_size;
+    c->forms = forms;
+
+    return lval_retain(forms);
+}
+
+/* Calls fn on every cached value, for the collector */
+void lcache_each(void (*fn)(lval *))
+{
+    for (size_t i = 0; i < lcache_count; i++) {
+        fn(lcache_entries[i].forms);
+    }
+}
+
+void lcache_cleanup(void)
+{
+    for (size_t i = 0; i < lcache_count; i++) {
+        lval_delete(lcache_entries[i].forms);
+        free(lcache_entries[i].path);
+    }
+    free(lcache_entries);
+
+    lcache_entries = NULL;
+    lcache_count = 0;
+}
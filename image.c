@@ -0,0 +1,524 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "lisp.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Images (`--dump-image=FILE`, `--image=FILE`).
+ *
+ * An image holds the global environment and everything reachable from
+ * it. It is a header and then one record per environment or boxed value,
+ * all made of native 64-bit words. Records refer to each other by
+ * position, and fixnums are stored as their tagged pointer bits. Record
+ * 0 is the global environment.
+ *
+ * Loading maps the file and makes two passes over it. The first pass
+ * allocates every object, with lists, lambdas and environments left
+ * empty. The second pass fixes up the references between them. Sharing
+ * between values is kept, and so are cycles through environments.
+ * Builtins are saved by name. The slots lambdas resolved are kept, but
+ * bytecode and call-site caches are not. Of a lambda's environment only
+ * the bindings are saved. Its parent link is meaningful only while a
+ * call is running.
+ */
+enum { LIMG_NUM, LIMG_ERR, LIMG_SYM, LIMG_STR, LIMG_BUILTIN,
+       LIMG_LAMBDA, LIMG_SEXPR, LIMG_QEXPR, LIMG_ENV };
+
+#define LIMG_MAGIC "LISPIMG1"
+
+typedef unsigned long long u64;
+
+/* object -> record number, for dumping */
+typedef struct limg_map {
+    size_t count;
+    size_t cap;
+    void **keys;
+    size_t *ids;
+    void **objs;
+    int *kinds;
+} limg_map;
+
+static size_t limg_hash(void *p, size_t cap)
+{
+    return (size_t)(((uintptr_t)p >> 4) * 2654435761u) & (cap - 1);
+}
+
+static void limg_map_grow(limg_map *m)
+{
+    size_t cap = m->cap ? m->cap * 2 : 256;
+    void **keys = calloc(cap, sizeof(void *));
+    size_t *ids = malloc(sizeof(size_t) * cap);
+
+    for (size_t i = 0; i < m->cap; i++) {
+        if (m->keys[i]) {
+            size_t j = limg_hash(m->keys[i], cap);
+            while (keys[j]) {
+                j = (j + 1) & (cap - 1);
+            }
+            keys[j] = m->keys[i];
+            ids[j] = m->ids[i];
+        }
+    }
+
+    free(m->keys);
+    free(m->ids);
+    m->keys = keys;
+    m->ids = ids;
+    m->cap = cap;
+    m->objs = realloc(m->objs, sizeof(void *) * cap);
+    m->kinds = realloc(m->kinds, sizeof(int) * cap);
+}
+
+/* The record number of p, numbering it next if it's new */
+static size_t limg_map_id(limg_map *m, void *p, int kind)
+{
+    size_t i;
+
+    if ((m->count + 1) * 2 > m->cap) {
+        limg_map_grow(m);
+    }
+
+    i = limg_hash(p, m->cap);
+    while (m->keys[i]) {
+        if (m->keys[i] == p) {
+            return m->ids[i];
+        }
+        i = (i + 1) & (m->cap - 1);
+    }
+
+    m->keys[i] = p;
+    m->ids[i] = m->count;
+    m->objs[m->count] = p;
+    m->kinds[m->count] = kind;
+
+    return m->count++;
+}
+
+static void limg_write_word(FILE *f, u64 x)
+{
+    fwrite(&x, sizeof(x), 1, f);
+}
+
+/* length, then the bytes padded to a whole word */
+static void limg_write_str(FILE *f, char *s)
+{
+    size_t n = strlen(s);
+    u64 pad = 0;
+
+    limg_write_word(f, n);
+    fwrite(s, 1, n, f);
+    fwrite(&pad, 1, (8 - n % 8) % 8, f);
+}
+
+static u64 limg_write_ref(limg_map *m, lval *v)
+{
+    if (LVAL_IS_FIXNUM(v)) {
+        return (u64)(uintptr_t)v;
+    }
+
+    return (u64)(limg_map_id(m, v, -1) + 1) << 1;
+}
+
+static int limg_write_env(FILE *f, limg_map *m, lenv *e)
+{
+    limg_write_word(f, LIMG_ENV);
+    limg_write_word(f, e->frame);
+    limg_write_word(f, e->count);
+
+    for (size_t i = 0; i < e->cap; i++) {
+        if (e->syms[i]) {
+            limg_write_str(f, e->syms[i]);
+            limg_write_word(f, limg_write_ref(m, e->vals[i]));
+        }
+    }
+
+    return 1;
+}
+
+static int limg_write_val(FILE *f, limg_map *m, lval *v)
+{
+    switch (v->type) {
+    case LVAL_NUM:
+        limg_write_word(f, LIMG_NUM);
+        limg_write_word(f, (u64)v->num);
+        break;
+    case LVAL_ERR:
+        limg_write_word(f, LIMG_ERR);
+        limg_write_str(f, v->err);
+        break;
+    case LVAL_SYM:
+        limg_write_word(f, LIMG_SYM);
+        limg_write_word(f, v->slot);
+        limg_write_str(f, v->sym);
+        break;
+    case LVAL_STR:
+        limg_write_word(f, LIMG_STR);
+        limg_write_str(f, v->str);
+        break;
+    case LVAL_FUN:
+        if (v->builtin) {
+            if (!lbuiltin_name(v->builtin)) {
+                return 0;
+            }
+            limg_write_word(f, LIMG_BUILTIN);
+            limg_write_str(f, lbuiltin_name(v->builtin));
+        } else {
+            limg_write_word(f, LIMG_LAMBDA);
+            limg_write_word(f, (u64)(limg_map_id(m, v->env, LIMG_ENV) + 1)
+                                   << 1);
+            limg_write_word(f, limg_write_ref(m, v->formals));
+            limg_write_word(f, limg_write_ref(m, v->body));
+        }
+        break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+        limg_write_word(f, v->type == LVAL_SEXPR ? LIMG_SEXPR : LIMG_QEXPR);
+        limg_write_word(f, v->count);
+        for (size_t i = 0; i < v->count; i++) {
+            limg_write_word(f, limg_write_ref(m, v->cell[i]));
+        }
+        break;
+    }
+
+    return 1;
+}
+
+/* Writes e and everything it reaches to path. Returns 0 on failure */
+int limg_dump(lenv *e, char *path)
+{
+    limg_map m = {0, 0, NULL, NULL, NULL, NULL};
+    FILE *f = fopen(path, "wb");
+    size_t count;
+    int ok = f != NULL;
+
+    if (!ok) {
+        return 0;
+    }
+
+    /* the count is patched in at the end */
+    fwrite(LIMG_MAGIC, 1, 8, f);
+    limg_write_word(f, 0);
+
+    /* records are written in numbering order, which writing extends */
+    limg_map_id(&m, e, LIMG_ENV);
+    for (size_t i = 0; ok && i < m.count; i++) {
+        if (m.kinds[i] == LIMG_ENV) {
+            ok = limg_write_env(f, &m, m.objs[i]);
+        } else {
+            ok = limg_write_val(f, &m, m.objs[i]);
+        }
+    }
+    count = m.count;
+
+    free(m.keys);
+    free(m.ids);
+    free(m.objs);
+    free(m.kinds);
+
+    if (ok) {
+        fseek(f, 8, SEEK_SET);
+        limg_write_word(f, count);
+    }
+
+    if (fclose(f) != 0 || !ok) {
+        remove(path);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* A cursor over the mapped file; bad is set on reading past the end */
+typedef struct limg_reader {
+    const u64 *p;
+    const u64 *end;
+    int bad;
+} limg_reader;
+
+static u64 limg_word(limg_reader *r)
+{
+    if (r->p >= r->end) {
+        r->bad = 1;
+        return 0;
+    }
+    return *r->p++;
+}
+
+/* Returns a copy of the next string, or NULL if it runs off the end */
+static char *limg_str(limg_reader *r)
+{
+    u64 n = limg_word(r);
+    u64 words = (n + 7) / 8;
+    char *s;
+
+    if (r->bad || n > (u64)(r->end - r->p) * 8) {
+        r->bad = 1;
+        return NULL;
+    }
+
+    s = malloc(n + 1);
+    memcpy(s, r->p, n);
+    s[n] = '\0';
+    r->p += words;
+
+    return s;
+}
+
+static void limg_skip_str(limg_reader *r)
+{
+    u64 n = limg_word(r);
+    u64 words = (n + 7) / 8;
+
+    if (r->bad || n > (u64)(r->end - r->p) * 8) {
+        r->bad = 1;
+        return;
+    }
+    r->p += words;
+}
+
+/* The value word refers to, or NULL if it isn't one */
+static lval *limg_val(u64 word, void **objs, int *kinds, size_t count)
+{
+    size_t i;
+
+    if (word & 1) {
+        return (lval *)(uintptr_t)word;
+    }
+
+    i = (size_t)(word >> 1) - 1;
+    if (word == 0 || i >= count || kinds[i] == LIMG_ENV) {
+        return NULL;
+    }
+
+    return objs[i];
+}
+
+/* First pass: allocates the object for the record at r */
+static void *limg_alloc(limg_reader *r, int *kind)
+{
+    u64 n;
+    char *s;
+    lval *v = NULL;
+    lenv *e;
+
+    *kind = (int)limg_word(r);
+
+    switch (*kind) {
+    case LIMG_NUM:
+        return lval_num((long)limg_word(r));
+    case LIMG_ERR:
+    case LIMG_STR:
+    case LIMG_BUILTIN:
+        s = limg_str(r);
+        if (!s) {
+            return NULL;
+        }
+        if (*kind == LIMG_ERR) {
+            v = lval_err("%s", s);
+        } else if (*kind == LIMG_STR) {
+            v = lval_str(s);
+        } else if (lbuiltin_find(s)) {
+            v = lval_builtin(lbuiltin_find(s));
+        }
+        free(s);
+        return v;
+    case LIMG_SYM:
+        n = limg_word(r);
+        s = limg_str(r);
+        if (!s) {
+            return NULL;
+        }
+        v = lval_sym(s);
+        v->slot = (size_t)n;
+        free(s);
+        return v;
+    case LIMG_LAMBDA:
+        if (r->end - r->p < 3) {
+            return NULL;
+        }
+        r->p += 3;
+        return lval_lambda(lval_qexpr(), lval_qexpr());
+    case LIMG_SEXPR:
+    case LIMG_QEXPR:
+        n = limg_word(r);
+        if (r->bad || n > (u64)(r->end - r->p)) {
+            return NULL;
+        }
+        r->p += n;
+        return *kind == LIMG_SEXPR ? lval_sexpr() : lval_qexpr();
+    case LIMG_ENV:
+        e = limg_word(r) ? lenv_frame(NULL) : lenv_new();
+        n = limg_word(r);
+        for (; n > 0 && !r->bad; n--) {
+            limg_skip_str(r);
+            limg_word(r);
+        }
+        return e;
+    }
+
+    return NULL;
+}
+
+/* Second pass: fills in the references of the record at r */
+static int limg_fixup(limg_reader *r, void *obj, void **objs, int *kinds,
+                      size_t count)
+{
+    int kind = (int)limg_word(r);
+    lval *v = obj;
+    lenv *e = obj;
+    lval *x;
+    u64 word;
+    u64 n;
+    char *s;
+
+    switch (kind) {
+    case LIMG_NUM:
+        limg_word(r);
+        break;
+    case LIMG_ERR:
+    case LIMG_STR:
+    case LIMG_BUILTIN:
+        limg_skip_str(r);
+        break;
+    case LIMG_SYM:
+        limg_word(r);
+        limg_skip_str(r);
+        break;
+    case LIMG_LAMBDA:
+        word = limg_word(r);
+        if (word == 0 || (word >> 1) - 1 >= count ||
+            kinds[(word >> 1) - 1] != LIMG_ENV) {
+            return 0;
+        }
+        lenv_delete(v->env);
+        v->env = lenv_retain(objs[(word >> 1) - 1]);
+
+        x = limg_val(limg_word(r), objs, kinds, count);
+        if (!x || LVAL_TYPE(x) != LVAL_QEXPR) {
+            return 0;
+        }
+        lval_delete(v->formals);
+        v->formals = lval_retain(x);
+
+        x = limg_val(limg_word(r), objs, kinds, count);
+        if (!x || LVAL_TYPE(x) != LVAL_QEXPR) {
+            return 0;
+        }
+        lval_delete(v->body);
+        v->body = lval_retain(x);
+        break;
+    case LIMG_SEXPR:
+    case LIMG_QEXPR:
+        for (n = limg_word(r); n > 0; n--) {
+            x = limg_val(limg_word(r), objs, kinds, count);
+            if (!x) {
+                return 0;
+            }
+            v = lval_add(v, lval_retain(x));
+        }
+        break;
+    case LIMG_ENV:
+        limg_word(r);
+        for (n = limg_word(r); n > 0; n--) {
+            lval *k;
+
+            s = limg_str(r);
+            x = limg_val(limg_word(r), objs, kinds, count);
+            if (!s || !x) {
+                free(s);
+                return 0;
+            }
+            k = lval_sym(s);
+            lenv_put(e, k, x);
+            lval_delete(k);
+            free(s);
+        }
+        break;
+    }
+
+    return !r->bad;
+}
+
+/* Reads the global environment saved in path, or returns NULL */
+lenv *limg_load(char *path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    void *map;
+    limg_reader r;
+    void **objs;
+    int *kinds;
+    size_t count;
+    size_t i;
+    lenv *e = NULL;
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < 16 || st.st_size % 8 != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    r.p = (const u64 *)map + 2;
+    r.end = (const u64 *)map + st.st_size / 8;
+    r.bad = 0;
+    count = (size_t)((const u64 *)map)[1];
+
+    if (memcmp(map, LIMG_MAGIC, 8) != 0 || count == 0 ||
+        count > (size_t)st.st_size / 8) {
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+
+    objs = calloc(count, sizeof(void *));
+    kinds = malloc(sizeof(int) * count);
+
+    for (i = 0; i < count && !r.bad; i++) {
+        objs[i] = limg_alloc(&r, &kinds[i]);
+        if (!objs[i]) {
+            break;
+        }
+    }
+
+    /* the records again, now that every object has an address */
+    if (i == count && !r.bad && kinds[0] == LIMG_ENV) {
+        ((lenv *)objs[0])->global = 1;
+        r.p = (const u64 *)map + 2;
+        for (i = 0; i < count; i++) {
+            if (!limg_fixup(&r, objs[i], objs, kinds, count)) {
+                break;
+            }
+        }
+        if (i == count) {
+            e = lenv_retain(objs[0]);
+        }
+    }
+
+    /* drop the references the table held */
+    for (i = 0; i < count && objs[i]; i++) {
+        if (kinds[i] == LIMG_ENV) {
+            lenv_delete(objs[i]);
+        } else {
+            lval_delete(objs[i]);
+        }
+    }
+
+    free(objs);
+    free(kinds);
+    munmap(map, (size_t)st.st_size);
+
+    return e;
+}
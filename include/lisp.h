@@ -1,78 +1,257 @@
 #ifndef LISP_H
 #define LISP_H
 #include "mpc.h"
-
-extern mpc_parser_t *Number;
-extern mpc_parser_t *Symbol;
-extern mpc_parser_t *Comment;
-extern mpc_parser_t *Sexpr;
-extern mpc_parser_t *Qexpr;
-extern mpc_parser_t *String;
-extern mpc_parser_t *Expr;
-extern mpc_parser_t *Lispy;
+#include <limits.h>
+#include <stdint.h>
 
 typedef struct lenv lenv;
 typedef struct lval lval;
+typedef struct lstats lstats;
+typedef struct lcells lcells;
+typedef struct lcode lcode;
 typedef lval *(*lbuiltin)(lenv *, lval *);
 
+/*
+ * Values and environments are reference counted. A value with refs > 1
+ * is shared and must not be mutated: take a private version with
+ * lval_unshare() first. lval_delete() drops one reference and frees the
+ * value once the last one is gone.
+ */
 struct lval {
-    size_t type;
-    size_t count;
+    unsigned char type;
+    unsigned char mark;
+    unsigned char op; /* LOP_* for operator builtins */
+    unsigned int refs;
+
+    union {
+        long num; /* only numbers too big for a fixnum are boxed */
+        char *err;
+        char *str;
 
-    long num;
-    char *err;
-    char *sym;
-    char *str;
+        /*
+         * slot is 1 + the frame slot lval_resolve expects sym in, or 0.
+         * At call sites, target caches the global sym named while
+         * lenv_version was equal to version (see lenv_get_head).
+         */
+        struct {
+            char *sym;
+            size_t slot;
+            size_t version;
+            lval *target;
+        };
 
-    /* function-related fields */
-    lbuiltin builtin;
-    lenv *env;
-    lval *formals;
-    lval *body;
+        /* function-related fields */
+        struct {
+            lbuiltin builtin;
+            lenv *env;
+            lval *formals;
+            lval *body;
+        };
 
-    lval **cell;
+        /* cell[0 .. count) is a window into cells->items */
+        struct {
+            size_t count;
+            lval **cell;
+            lcells *cells;
+            lcode *code; /* compiled form, dropped when the list changes */
+        };
+    };
 }; /* lval stands for lisp value */
 
+/*
+ * Storage behind S/Q-expressions. items[lo .. hi) hold references, and
+ * every list using the storage sees a window inside that range, so
+ * copying a list or taking its tail shares the storage instead of
+ * cloning it. Lists are immutable once shared: writers go through
+ * lval_unshare() and the storage is copied only if others can see the
+ * slots being changed.
+ */
+struct lcells {
+    size_t refs;
+    size_t cap;
+    size_t lo;
+    size_t hi;
+    lval *items[];
+};
+
+/*
+ * Bytecode for one S-expression, see vm.c. ops holds (opcode, operand)
+ * pairs; consts holds a reference to every value the code pushes.
+ */
+struct lcode {
+    size_t count;
+    int *ops;
+    size_t nconsts;
+    lval **consts;
+    size_t depth; /* stack slots needed by the code */
+};
+
+/*
+ * Integers in [LFIX_MIN, LFIX_MAX] are never allocated: the lval pointer
+ * itself holds the value shifted left by one with the low bit set. Heap
+ * lvals are always aligned, so their low bit is clear. Use LVAL_TYPE and
+ * LVAL_NUMVAL rather than v->type and v->num on anything that may be a
+ * number; lval_retain and lval_delete ignore fixnums.
+ */
+#define LFIX_MAX (LONG_MAX >> 1)
+#define LFIX_MIN (LONG_MIN >> 1)
+
+#define LVAL_IS_FIXNUM(v) (((uintptr_t)(v)) & 1)
+#define LVAL_FIXNUM(x) ((lval *)(((uintptr_t)(x) << 1) | 1))
+#define LVAL_TYPE(v) (LVAL_IS_FIXNUM(v) ? LVAL_NUM : (v)->type)
+#define LVAL_NUMVAL(v)                                                 \
+    (LVAL_IS_FIXNUM(v) ? (long)((intptr_t)(v) >> 1) : (v)->num)
+
+/*
+ * Bindings live in an open-addressing hash table with linear probing,
+ * keyed on interned symbol pointers. cap is zero or a power of two,
+ * empty slots have a NULL sym.
+ *
+ * Call frames (frame set) start out linear instead: up to
+ * LENV_FRAME_SLOTS bindings in parameter order in syms/vals[0 .. count),
+ * searched linearly, with NULL syms after them. A frame that outgrows
+ * its slots becomes a table. The global environment has the global
+ * flag set; lenv_put and lenv_unbind keep the symbols' global cells in
+ * step with it.
+ */
 struct lenv {
+    unsigned char mark;
+    unsigned char frame;
+    unsigned char linear;
+    unsigned char global;
+    unsigned int refs;
     lenv *par;
     size_t count;
+    size_t cap;
     char **syms;
     lval **vals;
 };
 
+/* environments held by a tail-calling loop until it returns */
+typedef struct lframes {
+    size_t count;
+    size_t cap;
+    lenv **envs;
+} lframes;
+
+void lframes_enter(lframes *fr, lenv **e, lenv *callee);
+void lframes_release(lframes *fr);
+
+#define LENV_MIN_CAP 8
+#define LENV_FRAME_SLOTS 8
+#define LVAL_MIN_CAP 4
+#define LOP_ARGS_MAX 8
+
 enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, LVAL_STR,
        LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
 
 enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
 
+/* operator builtins, resolved once when the builtin value is created */
+enum { LOP_NONE, LOP_ADD, LOP_SUB, LOP_MUL, LOP_DIV,
+       LOP_GT, LOP_LT, LOP_GE, LOP_LE, LOP_EQ, LOP_NE };
+
+/* allocation and collector counters, reported by `--stats` */
+struct lstats {
+    size_t lval_allocs;
+    size_t lenv_allocs;
+
+    size_t gc_runs;
+    size_t gc_reclaimed;   /* objects freed by the collector */
+    double gc_pause_total; /* seconds */
+    double gc_pause_max;
+    size_t heap_bytes;     /* slab memory at the last collection */
+    size_t heap_live;      /* objects reachable at the last collection */
+
+    size_t folded;         /* calls replaced by their value, see `--fold` */
+
+    size_t load_parses;    /* files `load` ran through the reader */
+    size_t load_hits;      /* files `load` took from the parse cache */
+
+    size_t packrat_lookups; /* expr rule runs, see `--packrat` */
+    size_t packrat_hits;    /* of those, answered from the memo table */
+};
+
+extern lstats lisp_stats;
+extern int lgc_enabled;
+extern int lisp_fold;
+extern size_t lenv_version;
+
+/* evaluator used for function bodies, `if` and `eval` */
+enum { LENGINE_TREE, LENGINE_VM };
+
+extern int lisp_engine;
+
+void lgc_push_root(lval *v);
+void lgc_pop_root(void);
+void lgc_collect(lenv *e);
+
 char *ltype_name(size_t t);
 
+lcode *lcode_compile(lval *v);
+void lcode_delete(lcode *c);
+lval *lvm_evaluate(lenv *e, lval *v);
+void lvm_cleanup(void);
+
+/* reader used for loaded files and the REPL */
+enum { LREADER_DIRECT, LREADER_MPC };
+
+extern int lisp_reader;
+extern int lisp_packrat;
+
+lval *lread(char *filename, char *src);
+lval *lread_mpc(char *filename, char *src);
+char *lread_file(char *path, size_t *len);
+void lread_bench(char *path);
+void lread_cleanup(void);
+
+extern char *lcache_dir;
+
+lval *lcache_load(char *path);
+void lcache_each(void (*fn)(lval *));
+void lcache_cleanup(void);
+
+lenv *limg_load(char *path);
+int limg_dump(lenv *e, char *path);
+
+char *lbuiltin_name(lbuiltin func);
+lbuiltin lbuiltin_find(char *name);
+
+char *lsym_intern(char *s);
+void lisp_cleanup(void);
+
 void lval_expr_print(lval *v, char open, char close);
 lval *lval_evaluate(lenv *e, lval *v);
+lval *lval_evaluate_toplevel(lenv *e, lval *v);
 lval *lval_num(long x);
 lval *lval_err(char *fmt, ...);
 lval *lval_sym(char *s);
 lval *lval_sexpr(void);
 lval *lval_qexpr(void);
 lval *lval_str(char *s);
-lval *lval_fun(lbuiltin func);
+lval *lval_builtin(lbuiltin func);
 void lval_delete(lval *v);
 lval *lval_add(lval *v, lval *x);
-lval *lval_read_num(mpc_ast_t *node);
-lval *lval_read_str(mpc_ast_t *node);
-lval *lval_read(mpc_ast_t *node);
 void lval_print(lval *v);
 lval *lval_pop(lval *v, size_t i);
 lval *lval_take(lval *v, size_t i);
 lval *lval_copy(lval *v);
+lval *lval_retain(lval *v);
+lval *lval_unshare(lval *v);
 lval *lval_evaluate_sexpr(lenv *e, lval *v);
 lval *lval_join(lval *x, lval *y);
+lval *lval_fold(lenv *e, lval *formals, lval *v);
 lval *lval_evaluate(lenv *e, lval *v);
 void lval_expr_print(lval *v, char open, char close);
 void lval_println(lval *v);
 lval *lval_lambda(lval *formals, lval *body);
+lval *lval_call(lenv *e, lval *f, lval *a);
+lval *lval_bind(lenv *e, lval *f, lval *a, lenv **frame);
+lval *lval_if_branch(lval *a);
+lval *lval_eval_expr(lval *a);
+lval *lval_call_op(lenv *e, lval *f, lval **args, size_t count);
 
-lval *builtin_op(lenv *e, lval *a, char *op);
+lval *builtin_op(lenv *e, lval *a, int op);
 lval *builtin_var(lenv *e, lval *a, char *func);
 lval *builtin_head(lenv *e, lval *a);
 lval *builtin_tail(lenv *e, lval *a);
@@ -89,18 +268,22 @@ lval *builtin_gt(lenv *e, lval *a);
 lval *builtin_lt(lenv *e, lval *a);
 lval *builtin_ge(lenv *e, lval *a);
 lval *builtin_le(lenv *e, lval *a);
-lval *builtin_ord(lenv *e, lval *a, char *op);
-lval *builtin_cmp(lenv *e, lval *a, char *op);
+lval *builtin_eq(lenv *e, lval *a);
+lval *builtin_ne(lenv *e, lval *a);
+lval *builtin_ord(lenv *e, lval *a, int op);
+lval *builtin_cmp(lenv *e, lval *a, int op);
 lval *builtin_if(lenv *e, lval *a);
 lval *builtin_lambda(lenv *e, lval *a);
-lval *builtin(lenv *e, lval *a, char *func);
 lval *builtin_load(lenv *e, lval *a);
 lval *builtin_print(lenv *e, lval *a);
 
 lenv *lenv_new(void);
+lenv *lenv_frame(lenv *par);
 void lenv_delete(lenv *e);
 lval *lenv_get(lenv *e, lval *k);
-lenv *lenv_copy(lenv *e);
+lval *lenv_get_head(lenv *e, lval *k);
+int lenv_shadows(lenv *e, lenv *x);
+lenv *lenv_retain(lenv *e);
 void lenv_put(lenv *e, lval *k, lval *v);
 void lenv_add_builtins(lenv *e);
 void lenv_add_builtin(lenv *e, char *name, lbuiltin func);
@@ -71,6 +71,8 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+char *mpc_read_file(FILE *file, size_t *length);
+
 /*
 ** Function Types
 */
@@ -81,6 +83,7 @@ typedef mpc_val_t*(*mpc_ctor_t)(void);
 typedef mpc_val_t*(*mpc_apply_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_apply_to_t)(mpc_val_t*,void*);
 typedef mpc_val_t*(*mpc_fold_t)(int,mpc_val_t**);
+typedef mpc_val_t*(*mpc_copy_t)(mpc_val_t*);
 
 typedef int(*mpc_check_t)(mpc_val_t**);
 typedef int(*mpc_check_with_t)(mpc_val_t**,void*);
@@ -148,6 +151,19 @@ mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
 
+/*
+** Packrat Parsing
+**
+** mpc_packrat(a, c, d) remembers the result of a at every position of
+** a string input, so trying it at the same place again returns a copy
+** made with c instead of parsing again. Remembered outputs are released
+** with d at the end of the parse. mpc_packrat_stats reports how many
+** times it was tried and how many of those were answered from memory.
+*/
+
+mpc_parser_t *mpc_packrat(mpc_parser_t *a, mpc_copy_t c, mpc_dtor_t d);
+void mpc_packrat_stats(mpc_parser_t *p, long *lookups, long *hits);
+
 /*
 ** Common Parsers
 */
@@ -353,7 +369,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
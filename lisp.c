@@ -1,8 +1,10 @@
 #include "lisp.h"
 #include "mpc.h"
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define LASSERT(args, cond, fmt, ...)                                  \
     do {                                                               \
@@ -14,10 +16,10 @@
     } while (0)
 
 #define LASSERT_TYPE(func, args, index, expect)                        \
-    LASSERT(args, args->cell[index]->type == expect,                   \
+    LASSERT(args, LVAL_TYPE(args->cell[index]) == expect,              \
             "Function '%s' passed incorrect type "                     \
             "for argument %i. Got %s, Expected %s.",                   \
-            func, index, ltype_name(args->cell[index]->type),          \
+            func, index, ltype_name(LVAL_TYPE(args->cell[index])),     \
             ltype_name(expect))
 
 #define LASSERT_NUM(func, args, num)                                   \
@@ -30,14 +32,8 @@
     LASSERT(args, args->cell[index]->count != 0,                       \
             "Function '%s' passed {} for argument %i.", func, index);
 
-mpc_parser_t *Number;
-mpc_parser_t *Symbol;
-mpc_parser_t *Comment;
-mpc_parser_t *Sexpr;
-mpc_parser_t *Qexpr;
-mpc_parser_t *String;
-mpc_parser_t *Expr;
-mpc_parser_t *Lispy;
+
+lstats lisp_stats;
 
 char *ltype_name(size_t t)
 {
@@ -61,19 +57,543 @@ char *ltype_name(size_t t)
     }
 }
 
+/*
+ * Symbol names are interned process-wide: every LVAL_SYM and every lenv
+ * key points at the single canonical copy of its name, so symbols are
+ * compared by pointer and never freed individually.
+ *
+ * The name sits at the end of an lsym header. global is the symbol's
+ * value in the global environment (kept up to date by lenv_put) and
+ * locals counts its bindings in live call frames; while that is zero
+ * nothing can shadow the global, and lenv_get returns it directly.
+ */
+typedef struct lsym {
+    size_t locals;
+    lval *global;
+    char name[];
+} lsym;
+
+#define LSYM(s) ((lsym *)((s) - offsetof(lsym, name)))
+
+static char **lsym_table;
+static size_t lsym_count;
+static size_t lsym_cap;
+
+/* FNV-1a */
+static size_t lsym_hash(char *s)
+{
+    size_t h = 2166136261u;
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static size_t lsym_slot(char **table, size_t cap, char *s)
+{
+    size_t i = lsym_hash(s) & (cap - 1);
+
+    while (table[i] && strcmp(table[i], s) != 0) {
+        i = (i + 1) & (cap - 1);
+    }
+
+    return i;
+}
+
+char *lsym_intern(char *s)
+{
+    size_t i;
+
+    if ((lsym_count + 1) * 2 > lsym_cap) {
+        size_t cap = lsym_cap ? lsym_cap * 2 : 256;
+        char **table = calloc(cap, sizeof(char *));
+
+        for (size_t j = 0; j < lsym_cap; j++) {
+            if (lsym_table[j]) {
+                table[lsym_slot(table, cap, lsym_table[j])] = lsym_table[j];
+            }
+        }
+
+        free(lsym_table);
+        lsym_table = table;
+        lsym_cap = cap;
+    }
+
+    i = lsym_slot(lsym_table, lsym_cap, s);
+
+    if (!lsym_table[i]) {
+        lsym *sym = malloc(sizeof(lsym) + strlen(s) + 1);
+
+        sym->locals = 0;
+        sym->global = NULL;
+        strcpy(sym->name, s);
+        lsym_table[i] = sym->name;
+        lsym_count++;
+    }
+
+    return lsym_table[i];
+}
+
+static void lsym_cleanup(void)
+{
+    for (size_t i = 0; i < lsym_cap; i++) {
+        if (lsym_table[i]) {
+            free(LSYM(lsym_table[i]));
+        }
+    }
+    free(lsym_table);
+
+    lsym_table = NULL;
+    lsym_count = 0;
+    lsym_cap = 0;
+}
+
+/*
+ * lval and lenv headers come from fixed-size slabs: objects are carved
+ * out of LSLAB_OBJECTS-sized chunks and recycled through a free list
+ * threaded through the dead objects. Build with -DLISP_MALLOC to use
+ * plain malloc/free instead, so ASan can see each object.
+ *
+ * A free slot has LSLAB_FREE in its first byte (where live objects keep
+ * their type or mark) and the free list link in its second word, which
+ * lets the collector below tell free slots from live ones.
+ */
+#define LSLAB_OBJECTS 512
+#define LSLAB_FREE 0xff
+#define LSLAB_LINK(p) (*(void **)((char *)(p) + sizeof(void *)))
+
+typedef struct lslab {
+    size_t size;
+    void *free;
+    char *next;
+    char *end;
+    void *chunks;
+} lslab;
+
+static lslab lval_slab = { sizeof(lval), NULL, NULL, NULL, NULL };
+static lslab lenv_slab = { sizeof(lenv), NULL, NULL, NULL, NULL };
+
+/* syms and vals of a call frame share one block */
+static lslab lslot_slab = { sizeof(void *) * 2 * LENV_FRAME_SLOTS,
+                            NULL, NULL, NULL, NULL };
+
+#ifdef LISP_MALLOC
+
+static void *lslab_alloc(lslab *s) { return malloc(s->size); }
+
+static void lslab_free(lslab *s, void *p)
+{
+    (void)s;
+    free(p);
+}
+
+static void lslab_cleanup(lslab *s) { (void)s; }
+
+#else
+
+static void *lslab_alloc(lslab *s)
+{
+    void *p = s->free;
+
+    if (p) {
+        s->free = LSLAB_LINK(p);
+        return p;
+    }
+
+    if (s->next == s->end) {
+        /* first word of each chunk links it into s->chunks */
+        char *chunk = malloc(sizeof(void *) + s->size * LSLAB_OBJECTS);
+
+        *(void **)chunk = s->chunks;
+        s->chunks = chunk;
+        s->next = chunk + sizeof(void *);
+        s->end = s->next + s->size * LSLAB_OBJECTS;
+    }
+
+    p = s->next;
+    s->next += s->size;
+
+    return p;
+}
+
+static void lslab_free(lslab *s, void *p)
+{
+    *(unsigned char *)p = LSLAB_FREE;
+    LSLAB_LINK(p) = s->free;
+    s->free = p;
+}
+
+static void lslab_cleanup(lslab *s)
+{
+    while (s->chunks) {
+        void *next = *(void **)s->chunks;
+        free(s->chunks);
+        s->chunks = next;
+    }
+
+    s->free = NULL;
+    s->next = NULL;
+    s->end = NULL;
+}
+
+#endif
+
+static lcells *lcells_new(size_t cap, size_t lo)
+{
+    lcells *c = malloc(sizeof(lcells) + sizeof(lval *) * cap);
+
+    c->refs = 1;
+    c->cap = cap;
+    c->lo = lo;
+    c->hi = lo;
+
+    return c;
+}
+
+static void lcells_release(lcells *c)
+{
+    if (--c->refs > 0) {
+        return;
+    }
+
+    for (size_t i = c->lo; i < c->hi; i++) {
+        lval_delete(c->items[i]);
+    }
+    free(c);
+}
+
+/*
+ * Optional mark-and-sweep collector (enabled with `--gc`).
+ *
+ * Reference counting frees almost everything as soon as it becomes
+ * unreachable; the collector is a backstop for whatever refcounts miss
+ * and the source of heap statistics. It only runs at safe points
+ * between top-level forms, where the only live values are the global
+ * environment and the values registered with lgc_push_root(). Parent
+ * links of environments are borrowed and are not traced.
+ */
+#define LGC_ROOTS_MIN 16
+
+int lgc_enabled;
+
+static lval **lgc_roots;
+static size_t lgc_nroots;
+static size_t lgc_roots_cap;
+static size_t lgc_busy;
+
+void lgc_push_root(lval *v)
+{
+    if (lgc_nroots == lgc_roots_cap) {
+        lgc_roots_cap = lgc_roots_cap ? lgc_roots_cap * 2 : LGC_ROOTS_MIN;
+        lgc_roots = realloc(lgc_roots, sizeof(lval *) * lgc_roots_cap);
+    }
+    lgc_roots[lgc_nroots++] = v;
+}
+
+void lgc_pop_root(void) { lgc_nroots--; }
+
+static void lgc_mark_env(lenv *e);
+static void lenv_free_slots(lenv *e);
+static void lenv_unbind(lenv *e);
+
+static void lgc_mark(lval *v)
+{
+    if (LVAL_IS_FIXNUM(v) || v->mark) {
+        return;
+    }
+    v->mark = 1;
+
+    switch (v->type) {
+    case LVAL_FUN:
+        if (!v->builtin) {
+            lgc_mark_env(v->env);
+            lgc_mark(v->formals);
+            lgc_mark(v->body);
+        }
+        break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+        /* the storage owns every item in it, not just this window */
+        if (v->cells) {
+            for (size_t i = v->cells->lo; i < v->cells->hi; i++) {
+                lgc_mark(v->cells->items[i]);
+            }
+        }
+        if (v->code) {
+            for (size_t i = 0; i < v->code->nconsts; i++) {
+                lgc_mark(v->code->consts[i]);
+            }
+        }
+        break;
+    }
+}
+
+static void lgc_mark_env(lenv *e)
+{
+    if (e->mark) {
+        return;
+    }
+    e->mark = 1;
+
+    for (size_t i = 0; i < e->cap; i++) {
+        if (e->syms[i]) {
+            lgc_mark(e->vals[i]);
+        }
+    }
+}
+
+#ifdef LISP_MALLOC
+
+/* there is no heap to walk without the slabs */
+void lgc_collect(lenv *e) { (void)e; }
+
+#else
+
+/* Releases code owned by an unreachable list, like lgc_unlink below */
+static void lgc_unlink_code(lcode *c)
+{
+    for (size_t i = 0; i < c->nconsts; i++) {
+        if (!LVAL_IS_FIXNUM(c->consts[i]) && c->consts[i]->mark) {
+            c->consts[i]->refs--;
+        }
+    }
+    free(c->consts);
+    free(c->ops);
+    free(c);
+}
+
+/* Drops the references an unreachable object holds on reachable ones */
+static void lgc_unlink(lval *v)
+{
+    lval *children[3];
+    lval **cells = children;
+    size_t count = 0;
+
+    if (v->type == LVAL_FUN && !v->builtin) {
+        if (v->env->mark) {
+            v->env->refs--;
+        }
+        children[0] = v->formals;
+        children[1] = v->body;
+        count = 2;
+    }
+    if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->code) {
+        lgc_unlink_code(v->code);
+    }
+    if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->cells) {
+        /* storage dies with its last holder, reachable or not */
+        if (--v->cells->refs > 0) {
+            return;
+        }
+        cells = v->cells->items + v->cells->lo;
+        count = v->cells->hi - v->cells->lo;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (!LVAL_IS_FIXNUM(cells[i]) && cells[i]->mark) {
+            cells[i]->refs--;
+        }
+    }
+
+    if (cells != children) {
+        free(v->cells);
+    }
+}
+
+static void lgc_unlink_env(lenv *e)
+{
+    for (size_t i = 0; i < e->cap; i++) {
+        lval *v = e->vals[i];
+        if (e->syms[i] && !LVAL_IS_FIXNUM(v) && v->mark) {
+            v->refs--;
+        }
+    }
+}
+
+/* Calls fn on every slot the slab has handed out, free or not */
+static void lslab_each(lslab *s, void (*fn)(void *))
+{
+    char *chunk = s->chunks;
+    char *end = s->next;
+
+    while (chunk) {
+        for (char *p = chunk + sizeof(void *); p < end; p += s->size) {
+            if (*(unsigned char *)p != LSLAB_FREE) {
+                fn(p);
+            }
+        }
+        chunk = *(void **)chunk;
+        if (chunk) {
+            end = chunk + sizeof(void *) + s->size * LSLAB_OBJECTS;
+        }
+    }
+}
+
+static size_t lgc_live;
+static size_t lgc_freed;
+
+static void lgc_sweep_unlink(void *p)
+{
+    lval *v = p;
+    if (!v->mark) {
+        lgc_unlink(v);
+    }
+}
+
+static void lgc_sweep_unlink_env(void *p)
+{
+    lenv *e = p;
+    if (!e->mark) {
+        lgc_unlink_env(e);
+    }
+}
+
+static void lgc_sweep_free(void *p)
+{
+    lval *v = p;
+
+    if (v->mark) {
+        v->mark = 0;
+        lgc_live++;
+        return;
+    }
+
+    switch (v->type) {
+    case LVAL_ERR:
+        free(v->err);
+        break;
+    case LVAL_STR:
+        free(v->str);
+        break;
+    }
+    lslab_free(&lval_slab, v);
+    lgc_freed++;
+}
+
+static void lgc_sweep_free_env(void *p)
+{
+    lenv *e = p;
+
+    if (e->mark) {
+        e->mark = 0;
+        lgc_live++;
+        return;
+    }
+
+    lenv_unbind(e);
+    lenv_free_slots(e);
+    lslab_free(&lenv_slab, e);
+    lgc_freed++;
+}
+
+static size_t lslab_bytes(lslab *s)
+{
+    size_t bytes = 0;
+
+    for (char *chunk = s->chunks; chunk; chunk = *(void **)chunk) {
+        bytes += sizeof(void *) + s->size * LSLAB_OBJECTS;
+    }
+
+    return bytes;
+}
+
+void lgc_collect(lenv *e)
+{
+    clock_t start = clock();
+    double pause;
+
+    lgc_mark_env(e);
+    for (size_t i = 0; i < lgc_nroots; i++) {
+        lgc_mark(lgc_roots[i]);
+    }
+    lcache_each(lgc_mark);
+
+    /* fix up refcounts before anything is freed, marks must stay intact */
+    lslab_each(&lval_slab, lgc_sweep_unlink);
+    lslab_each(&lenv_slab, lgc_sweep_unlink_env);
+
+    lgc_live = 0;
+    lgc_freed = 0;
+    lslab_each(&lval_slab, lgc_sweep_free);
+    lslab_each(&lenv_slab, lgc_sweep_free_env);
+
+    pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    lisp_stats.gc_runs++;
+    lisp_stats.gc_reclaimed += lgc_freed;
+    lisp_stats.gc_pause_total += pause;
+    if (pause > lisp_stats.gc_pause_max) {
+        lisp_stats.gc_pause_max = pause;
+    }
+    lisp_stats.heap_live = lgc_live;
+    lisp_stats.heap_bytes = lslab_bytes(&lval_slab) + lslab_bytes(&lenv_slab) +
+                            lslab_bytes(&lslot_slab);
+}
+
+#endif
+
+/* Evaluates a top-level form, collecting afterwards if nothing is in flight */
+lval *lval_evaluate_toplevel(lenv *e, lval *v)
+{
+    lval *x;
+
+    lgc_busy++;
+    x = lval_evaluate(e, v);
+    lgc_busy--;
+
+    if (lgc_enabled && lgc_busy == 0) {
+        lgc_push_root(x);
+        lgc_collect(e);
+        lgc_pop_root();
+    }
+
+    return x;
+}
+
+void lisp_cleanup(void)
+{
+    lcache_cleanup();
+    lread_cleanup();
+    lvm_cleanup();
+    free(lgc_roots);
+    lgc_roots = NULL;
+    lgc_roots_cap = 0;
+    lsym_cleanup();
+    lslab_cleanup(&lval_slab);
+    lslab_cleanup(&lenv_slab);
+    lslab_cleanup(&lslot_slab);
+}
+
+static lval *lval_alloc(size_t type)
+{
+    lval *v = lslab_alloc(&lval_slab);
+    v->type = type;
+    v->mark = 0;
+    v->refs = 1;
+    lisp_stats.lval_allocs++;
+    return v;
+}
+
 lval *lval_num(long x)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
+    lval *v;
+
+    if (x >= LFIX_MIN && x <= LFIX_MAX) {
+        return LVAL_FIXNUM(x);
+    }
+
+    v = lval_alloc(LVAL_NUM);
     v->num = x;
     return v;
 }
 
 lval *lval_err(char *fmt, ...)
 {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc(LVAL_ERR);
     va_list va;
-    v->type = LVAL_ERR;
 
     va_start(va, fmt);
 
@@ -88,58 +608,77 @@ lval *lval_err(char *fmt, ...)
 
 lval *lval_sym(char *s)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
+    lval *v = lval_alloc(LVAL_SYM);
+    v->sym = lsym_intern(s);
+    v->slot = 0;
+    v->version = 0;
+    v->target = NULL;
     return v;
 }
 
 lval *lval_sexpr(void)
 {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc(LVAL_SEXPR);
 
-    v->type = LVAL_SEXPR;
     v->count = 0;
     v->cell = NULL;
+    v->cells = NULL;
+    v->code = NULL;
 
     return v;
 }
 
 lval *lval_qexpr(void)
 {
-    lval *v = malloc(sizeof(lval));
+    lval *v = lval_alloc(LVAL_QEXPR);
 
-    v->type = LVAL_QEXPR;
     v->count = 0;
     v->cell = NULL;
+    v->cells = NULL;
+    v->code = NULL;
 
     return v;
 }
 
 lval *lval_str(char *s)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_STR;
+    lval *v = lval_alloc(LVAL_STR);
     v->str = malloc(strlen(s) + 1);
     strcpy(v->str, s);
 
     return v;
 }
 
+static char *lop_name[] = { "", "+", "-", "*", "/",
+                            ">", "<", ">=", "<=", "==", "!=" };
+
+static unsigned char lop_of(lbuiltin func)
+{
+    if (func == builtin_add) return LOP_ADD;
+    if (func == builtin_sub) return LOP_SUB;
+    if (func == builtin_mul) return LOP_MUL;
+    if (func == builtin_div) return LOP_DIV;
+    if (func == builtin_gt) return LOP_GT;
+    if (func == builtin_lt) return LOP_LT;
+    if (func == builtin_ge) return LOP_GE;
+    if (func == builtin_le) return LOP_LE;
+    if (func == builtin_eq) return LOP_EQ;
+    if (func == builtin_ne) return LOP_NE;
+
+    return LOP_NONE;
+}
+
 lval *lval_builtin(lbuiltin func)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+    lval *v = lval_alloc(LVAL_FUN);
     v->builtin = func;
+    v->op = lop_of(func);
     return v;
 }
 
 lval *lval_lambda(lval *formals, lval *body)
 {
-    lval *v = malloc(sizeof(lval));
-
-    v->type = LVAL_FUN;
+    lval *v = lval_alloc(LVAL_FUN);
 
     v->builtin = NULL;
 
@@ -155,6 +694,10 @@ lval *lval_lambda(lval *formals, lval *body)
 
 void lval_delete(lval *v)
 {
+    if (LVAL_IS_FIXNUM(v) || --v->refs > 0) {
+        return;
+    }
+
     switch (v->type) {
     case LVAL_NUM:
         break;
@@ -168,191 +711,268 @@ void lval_delete(lval *v)
     case LVAL_ERR:
         free(v->err);
         break;
-    case LVAL_SYM:
-        free(v->sym);
-        break;
     case LVAL_STR:
         free(v->str);
         break;
     case LVAL_QEXPR:
     case LVAL_SEXPR:
-        for (size_t i = 0; i < v->count; i++) {
-            lval_delete(v->cell[i]);
+        if (v->cells) {
+            lcells_release(v->cells);
+        }
+        if (v->code) {
+            lcode_delete(v->code);
         }
-        free(v->cell);
         break;
     }
-    free(v);
+    lslab_free(&lval_slab, v);
 }
 
 lval *lval_call(lenv *e, lval *f, lval *a)
 {
-    int given;
-    int total;
+    lenv *frame;
+    lval *x;
 
     if (f->builtin) {
         return f->builtin(e, a);
     }
 
-    given = a->count;
-    total = f->formals->count;
+    x = lval_bind(e, f, a, &frame);
+    if (x) {
+        return x;
+    }
+
+    if (lisp_engine == LENGINE_VM) {
+        x = lvm_evaluate(frame, lval_retain(f->body));
+    } else {
+        x = builtin_eval(frame, lval_add(lval_sexpr(), lval_retain(f->body)));
+    }
+    lenv_delete(frame);
+
+    return x;
+}
+
+/*
+ * Binds the arguments a of lambda f in a new frame whose parent is the
+ * calling environment e; f itself is left untouched, so it can be
+ * shared. Returns NULL once every formal is bound, with the frame to
+ * run f->body in left in *frame. Otherwise returns the result of the
+ * call: an error, or a lambda over the remaining formals that carries
+ * the bindings made so far.
+ */
+lval *lval_bind(lenv *e, lval *f, lval *a, lenv **frame)
+{
+    lval *formals = f->formals;
+    lenv *env = lenv_frame(e);
+    lval *x;
+    size_t given = a->count;
+    size_t i = 0;
+    char *amp = lsym_intern("&");
+
+    /* bindings from an earlier partial application */
+    for (size_t j = 0; j < f->env->cap; j++) {
+        if (f->env->syms[j]) {
+            lval *k = lval_sym(f->env->syms[j]);
+            lenv_put(env, k, f->env->vals[j]);
+            lval_delete(k);
+        }
+    }
 
     while (a->count) {
         lval *sym;
 
-        if (f->formals->count == 0) {
+        if (i == formals->count) {
             lval_delete(a);
+            lenv_delete(env);
             return lval_err("Function passed too many arguments: "
                             "got %i, expected %i.",
-                            given, total);
+                            (int)given, (int)formals->count);
         }
 
-        sym = lval_pop(f->formals, 0);
+        sym = formals->cell[i++];
 
-        if (strcmp(sym->sym, "&") == 0) {
+        if (sym->sym == amp) {
 
-            if (f->formals->count != 1) {
+            if (i + 1 != formals->count) {
                 lval_delete(a);
+                lenv_delete(env);
                 return lval_err("Function format invalid. "
                                 "Symbol '&' not followed by single symbol.");
             }
 
-            lval *nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_delete(sym);
-            lval_delete(nsym);
+            /* the rest of the arguments become a list, a included */
+            x = builtin_list(e, a);
+            lenv_put(env, formals->cell[i++], x);
+            lval_delete(x);
+            a = NULL;
             break;
         }
 
         /* Pop the next argument from the list */
-        lval *val = lval_pop(a, 0);
-
-        /* Bind a copy into the function's environment */
-        lenv_put(f->env, sym, val);
-
-        /* Delete symbol and value */
-        lval_delete(sym);
-        lval_delete(val);
+        x = lval_pop(a, 0);
+        lenv_put(env, sym, x);
+        lval_delete(x);
     }
 
     /* Argument list is now bound so can be cleaned up */
-    lval_delete(a);
+    if (a) {
+        lval_delete(a);
+    }
 
     /* If '&' remains in formal list bind to empty list */
-    if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
+    if (i < formals->count && formals->cell[i]->sym == amp) {
 
         /* Check to ensure that & is not passed invalidly. */
-        if (f->formals->count != 2) {
+        if (i + 2 != formals->count) {
+            lenv_delete(env);
             return lval_err("Function format invalid. "
                             "Symbol '&' not followed by single symbol.");
         }
 
-        /* Pop and delete '&' symbol */
-        lval_delete(lval_pop(f->formals, 0));
+        x = lval_qexpr();
+        lenv_put(env, formals->cell[i + 1], x);
+        lval_delete(x);
+        i += 2;
+    }
 
-        /* Pop next symbol and create empty list */
-        lval *sym = lval_pop(f->formals, 0);
-        lval *val = lval_qexpr();
+    /* If all formals have been bound the body can run */
+    if (i == formals->count) {
+        *frame = env;
+        return NULL;
+    }
 
-        /* Bind to environment and delete */
-        lenv_put(f->env, sym, val);
-        lval_delete(sym);
-        lval_delete(val);
+    /* Otherwise return partially evaluated function */
+    x = lval_lambda(lval_retain(formals), lval_retain(f->body));
+    lenv_delete(x->env);
+    x->env = env;
+    for (; i > 0; i--) {
+        x->formals = lval_unshare(x->formals);
+        lval_delete(lval_pop(x->formals, 0));
     }
 
-    /* If all formals have been bound evaluate */
-    if (f->formals->count == 0) {
+    return x;
+}
 
-        /* Set environment parent to evaluation environment */
-        f->env->par = e;
+/*
+ * Moves a tail-calling loop from *e into the callee's frame, taking
+ * over the reference to it. A caller whose bindings are all shadowed
+ * by the callee can't be seen any more, so it is unlinked from the
+ * chain and, if the loop holds it, freed: self-recursive loops then run
+ * in constant space.
+ */
+void lframes_enter(lframes *fr, lenv **e, lenv *callee)
+{
+    lenv *caller = *e;
 
-        /* Evaluate and return */
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        /* Otherwise return partially evaluated function */
-        return lval_copy(f);
+    if (caller->par && lenv_shadows(callee, caller)) {
+        callee->par = caller->par;
+        if (fr->count && fr->envs[fr->count - 1] == caller) {
+            lenv_delete(caller);
+            fr->count--;
+        }
+    }
+
+    if (fr->count == fr->cap) {
+        fr->cap = fr->cap ? fr->cap * 2 : LENV_MIN_CAP;
+        fr->envs = realloc(fr->envs, sizeof(lenv *) * fr->cap);
     }
+    fr->envs[fr->count++] = callee;
+    *e = callee;
 }
 
-lval *lval_add(lval *v, lval *x)
+void lframes_release(lframes *fr)
 {
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-    v->cell[v->count - 1] = x;
-    return v;
+    for (size_t i = 0; i < fr->count; i++) {
+        lenv_delete(fr->envs[i]);
+    }
+    free(fr->envs);
 }
 
-lval *lval_read_num(mpc_ast_t *node)
+/* Drops v's compiled code before its cells change */
+static void lval_uncache(lval *v)
 {
-    long x = strtol(node->contents, NULL, 10);
-
-    errno = 0;
-    return errno != ERANGE ? lval_num(x) : lval_err("Invalid number");
+    if (v->code) {
+        lcode_delete(v->code);
+        v->code = NULL;
+    }
 }
 
-lval *lval_read_str(mpc_ast_t *node)
+/*
+ * Moves v's window into fresh storage of its own with at least `front`
+ * free slots before it and `back` after it. Growth is geometric on the
+ * side that needs room.
+ */
+static void lval_regrow(lval *v, size_t front, size_t back)
 {
-    char *unescaped;
-    lval *str;
+    lcells *old = v->cells;
+    size_t lo = front ? front + v->count : 0;
+    size_t cap = lo + v->count + (back ? back + v->count : 0);
+    lcells *c = lcells_new(cap < LVAL_MIN_CAP ? LVAL_MIN_CAP : cap, lo);
 
-    node->contents[strlen(node->contents) - 1] = '\0';
-    unescaped = malloc(strlen(node->contents + 1) + 1);
-    strcpy(unescaped, node->contents + 1);
-    unescaped = mpcf_unescape(unescaped);
-    str = lval_str(unescaped);
-    free(unescaped);
+    if (v->count) {
+        memcpy(c->items + lo, v->cell, sizeof(lval *) * v->count);
+    }
+    c->hi = lo + v->count;
+
+    /* take over old's references if nobody else can see them */
+    if (old && old->refs == 1 && v->cell == old->items + old->lo &&
+        v->count == old->hi - old->lo) {
+        free(old);
+    } else {
+        for (size_t i = 0; i < v->count; i++) {
+            lval_retain(v->cell[i]);
+        }
+        if (old) {
+            lcells_release(old);
+        }
+    }
 
-    return str;
+    v->cells = c;
+    v->cell = c->items + lo;
 }
 
-lval *lval_read(mpc_ast_t *node)
+/*
+ * Makes v's storage private so its cells can be overwritten in place.
+ * v itself must already be unshared.
+ */
+static void lval_own(lval *v)
 {
-    lval *x = NULL;
+    lcells *c = v->cells;
 
-    if (strstr(node->tag, "number")) {
-        return lval_read_num(node);
-    }
-    if (strstr(node->tag, "symbol")) {
-        return lval_sym(node->contents);
-    }
-    if (strstr(node->tag, "string")) {
-        return lval_read_str(node);
+    lval_uncache(v);
+    if (!c || (c->refs == 1 && v->cell == c->items + c->lo &&
+               v->count == c->hi - c->lo)) {
+        return;
     }
 
-    if (strcmp(node->tag, ">") == 0) {
-        x = lval_sexpr();
-    }
-    if (strstr(node->tag, "sexpr")) {
-        x = lval_sexpr();
-    }
-    if (strstr(node->tag, "qexpr")) {
-        x = lval_qexpr();
-    }
+    lval_regrow(v, 0, 0);
+}
 
-    for (int i = 0; i < node->children_num; i++) {
-        if (strcmp(node->children[i]->contents, "(") == 0) {
-            continue;
-        }
-        if (strcmp(node->children[i]->contents, ")") == 0) {
-            continue;
-        }
-        if (strcmp(node->children[i]->contents, "{") == 0) {
-            continue;
-        }
-        if (strcmp(node->children[i]->contents, "}") == 0) {
-            continue;
-        }
-        if (strcmp(node->children[i]->tag, "regex") == 0) {
-            continue;
-        }
-        if (strstr(node->tag, "comment")) {
-            continue;
-        }
+/*
+ * Makes room for `front` cells just before v's window and `back` just
+ * after it. Slots past the edge of the storage's used range are not
+ * visible to any other list, so a window that reaches that edge can
+ * grow into spare capacity even while the storage is shared.
+ */
+static void lval_extend(lval *v, size_t front, size_t back)
+{
+    lcells *c = v->cells;
 
-        x = lval_add(x, lval_read(node->children[i]));
+    lval_uncache(v);
+    if (c && (!front || (v->cell == c->items + c->lo && c->lo >= front)) &&
+        (!back || (v->cell + v->count == c->items + c->hi &&
+                   c->cap - c->hi >= back))) {
+        return;
     }
 
-    return x;
+    lval_regrow(v, front, back);
+}
+
+lval *lval_add(lval *v, lval *x)
+{
+    lval_extend(v, 0, 1);
+    v->cells->items[v->cells->hi++] = x;
+    v->count++;
+    return v;
 }
 
 void lval_print_str(lval *v)
@@ -366,9 +986,9 @@ void lval_print_str(lval *v)
 
 void lval_print(lval *v)
 {
-    switch (v->type) {
+    switch (LVAL_TYPE(v)) {
     case LVAL_NUM:
-        printf("%li", v->num);
+        printf("%li", LVAL_NUMVAL(v));
         break;
     case LVAL_ERR:
         printf("Error: %s", v->err);
@@ -401,12 +1021,29 @@ void lval_print(lval *v)
 
 lval *lval_pop(lval *v, size_t i)
 {
-    lval *x = v->cell[i];
+    lval *x;
+
+    lval_uncache(v);
+    if (i == 0) {
+        /* popping the front just moves the window */
+        lcells *c = v->cells;
 
-    memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
+        x = v->cell[0];
+        if (c->refs == 1 && v->cell == c->items + c->lo) {
+            c->lo++;
+        } else {
+            lval_retain(x);
+        }
+        v->cell++;
+    } else {
+        lval_own(v);
+        x = v->cell[i];
+        memmove(&v->cell[i], &v->cell[i + 1],
+                sizeof(lval *) * (v->count - i - 1));
+        v->cells->hi--;
+    }
 
     v->count--;
-    v->cell = realloc(v->cell, sizeof(lval *) * v->count);
 
     return x;
 }
@@ -419,20 +1056,35 @@ lval *lval_take(lval *v, size_t i)
     return x;
 }
 
+lval *lval_retain(lval *v)
+{
+    if (!LVAL_IS_FIXNUM(v)) {
+        v->refs++;
+    }
+    return v;
+}
+
+/* Shallow copy: children are shared with v, not cloned */
 lval *lval_copy(lval *v)
 {
-    lval *x = malloc(sizeof(lval));
-    x->type = v->type;
+    lval *x;
+
+    if (LVAL_IS_FIXNUM(v)) {
+        return v;
+    }
+
+    x = lval_alloc(v->type);
 
     switch (v->type) {
     case LVAL_FUN:
         if (v->builtin) {
             x->builtin = v->builtin;
+            x->op = v->op;
         } else {
             x->builtin = NULL;
-            x->env = lenv_copy(v->env);
-            x->formals = lval_copy(v->formals);
-            x->body = lval_copy(v->body);
+            x->env = lenv_retain(v->env);
+            x->formals = lval_retain(v->formals);
+            x->body = lval_retain(v->body);
         }
         break;
     case LVAL_NUM:
@@ -443,8 +1095,10 @@ lval *lval_copy(lval *v)
         strcpy(x->err, v->err);
         break;
     case LVAL_SYM:
-        x->sym = malloc(strlen(v->sym) + 1);
-        strcpy(x->sym, v->sym);
+        x->sym = v->sym;
+        x->slot = v->slot;
+        x->version = 0;
+        x->target = NULL;
         break;
     case LVAL_STR:
         x->str = malloc(strlen(v->str) + 1);
@@ -452,10 +1106,13 @@ lval *lval_copy(lval *v)
         break;
     case LVAL_SEXPR:
     case LVAL_QEXPR:
+        /* lists are views: the copy shares v's storage */
         x->count = v->count;
-        x->cell = malloc(sizeof(lval *) * x->count);
-        for (size_t i = 0; i < x->count; i++) {
-            x->cell[i] = lval_copy(v->cell[i]);
+        x->cell = v->cell;
+        x->cells = v->cells;
+        x->code = NULL;
+        if (x->cells) {
+            x->cells->refs++;
         }
         break;
     }
@@ -463,73 +1120,316 @@ lval *lval_copy(lval *v)
     return x;
 }
 
-lval *lval_evaluate_sexpr(lenv *e, lval *v)
+/* Returns v itself if we hold the only reference, otherwise a private copy */
+lval *lval_unshare(lval *v)
 {
-    lval *f;
-    lval *result;
+    lval *x;
 
-    for (size_t i = 0; i < v->count; i++) {
-        v->cell[i] = lval_evaluate(e, v->cell[i]);
+    if (LVAL_IS_FIXNUM(v) || v->refs == 1) {
+        return v;
     }
 
-    for (size_t i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) {
-            return lval_take(v, i);
+    x = lval_copy(v);
+    lval_delete(v);
+
+    return x;
+}
+
+/* Binary step of an operator; callers rule out division by zero */
+static long lop_apply(int op, long x, long y)
+{
+    switch (op) {
+    case LOP_ADD: return x + y;
+    case LOP_SUB: return x - y;
+    case LOP_MUL: return x * y;
+    case LOP_DIV: return x / y;
+    case LOP_GT: return x > y;
+    case LOP_LT: return x < y;
+    case LOP_GE: return x >= y;
+    case LOP_LE: return x <= y;
+    case LOP_EQ: return x == y;
+    case LOP_NE: return x != y;
+    }
+
+    return 0;
+}
+
+/*
+ * Applies an operator builtin to evaluated arguments held in a C array.
+ * Takes ownership of args. Anything that would raise an error (wrong
+ * arity, non-numbers, division by zero) goes through the builtin itself
+ * so the messages stay the same.
+ */
+lval *lval_call_op(lenv *e, lval *f, lval **args, size_t count)
+{
+    int op = f->op;
+    long x;
+    int fast = 1;
+
+    /* the common (op a b) case on two fixnums */
+    if (count == 2 && LVAL_IS_FIXNUM(args[0]) && LVAL_IS_FIXNUM(args[1]) &&
+        (op != LOP_DIV || LVAL_NUMVAL(args[1]) != 0)) {
+        return lval_num(lop_apply(op, LVAL_NUMVAL(args[0]),
+                                  LVAL_NUMVAL(args[1])));
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (LVAL_TYPE(args[i]) != LVAL_NUM) {
+            fast = 0;
+        }
+        if (op == LOP_DIV && i > 0 && LVAL_NUMVAL(args[i]) == 0) {
+            fast = 0;
         }
     }
+    if (op >= LOP_GT && count != 2) {
+        fast = 0;
+    }
 
-    if (v->count == 0) {
-        return v;
+    if (!fast) {
+        lval *a = lval_sexpr();
+        for (size_t i = 0; i < count; i++) {
+            a = lval_add(a, args[i]);
+        }
+        return f->builtin(e, a);
+    }
+
+    x = LVAL_NUMVAL(args[0]);
+
+    if (op == LOP_SUB && count == 1) {
+        x = -x;
+    }
+    for (size_t i = 1; i < count; i++) {
+        x = lop_apply(op, x, LVAL_NUMVAL(args[i]));
+    }
+
+    /* only boxed numbers need releasing */
+    for (size_t i = 0; i < count; i++) {
+        lval_delete(args[i]);
+    }
+
+    return lval_num(x);
+}
+
+/*
+ * (op a b ...) where op is a numeric builtin: evaluate the arguments into
+ * a local array instead of copying the (usually shared) call node.
+ */
+static lval *lval_evaluate_op(lenv *e, lval *v, lval *f)
+{
+    lval *args[LOP_ARGS_MAX];
+    lval *result = NULL;
+    size_t count = v->count - 1;
+
+    for (size_t i = 0; i < count; i++) {
+        args[i] = lval_evaluate(e, lval_retain(v->cell[i + 1]));
+    }
+    lval_delete(v);
+
+    for (size_t i = 0; i < count && !result; i++) {
+        if (LVAL_TYPE(args[i]) == LVAL_ERR) {
+            result = lval_retain(args[i]);
+        }
     }
-    if (v->count == 1) {
-        return lval_evaluate(e, lval_take(v, 0));
+
+    if (result) {
+        for (size_t i = 0; i < count; i++) {
+            lval_delete(args[i]);
+        }
+    } else {
+        result = lval_call_op(e, f, args, count);
     }
 
-    f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval *err = lval_err("S-Expression starts with incorrect type: "
-                             "got %s, expected %s.",
-                             ltype_name(f->type), ltype_name(LVAL_FUN));
+    lval_delete(f);
+
+    return result;
+}
+
+/*
+ * Calls in tail position (a lambda body, the chosen `if` branch, the
+ * argument of `eval`) replace v and e and go round the loop again
+ * instead of recursing, so iteration runs in constant C stack. Scoping
+ * is dynamic and a callee's environment still points at its caller's,
+ * so every environment entered here is kept until the loop is done.
+ */
+lval *lval_evaluate_sexpr(lenv *e, lval *v)
+{
+    lframes frames = {0, 0, NULL};
+    lenv *frame;
+    lval *f;
+    lval *x;
+    lval *head;
+    lval *result;
+    size_t i;
+
+    for (;;) {
+        head = NULL;
+
+        /* resolve the operator first, numeric calls never copy the node */
+        if (v->count > 1 && LVAL_TYPE(v->cell[0]) == LVAL_SYM) {
+            head = lenv_get_head(e, v->cell[0]);
+
+            if (LVAL_TYPE(head) == LVAL_FUN && head->builtin &&
+                head->op != LOP_NONE && v->count - 1 <= LOP_ARGS_MAX) {
+                result = lval_evaluate_op(e, v, head);
+                break;
+            }
+        }
+
+        v = lval_unshare(v);
+        lval_own(v);
+
+        if (head) {
+            lval_delete(v->cell[0]);
+            v->cell[0] = head;
+        }
+
+        for (i = head ? 1 : 0; i < v->count; i++) {
+            v->cell[i] = lval_evaluate(e, v->cell[i]);
+        }
+
+        for (i = 0; i < v->count && LVAL_TYPE(v->cell[i]) != LVAL_ERR; i++) {
+        }
+        if (i < v->count) {
+            result = lval_take(v, i);
+            break;
+        }
+
+        if (v->count == 0) {
+            result = v;
+            break;
+        }
+        if (v->count == 1) {
+            x = lval_take(v, 0);
+            if (LVAL_TYPE(x) == LVAL_SEXPR) {
+                v = x;
+                continue;
+            }
+            result = lval_evaluate(e, x);
+            break;
+        }
+
+        f = lval_pop(v, 0);
+        if (LVAL_TYPE(f) != LVAL_FUN) {
+            result = lval_err("S-Expression starts with incorrect type: "
+                              "got %s, expected %s.",
+                              ltype_name(LVAL_TYPE(f)), ltype_name(LVAL_FUN));
+            lval_delete(f);
+            lval_delete(v);
+            break;
+        }
+
+        if (f->builtin && f->builtin != builtin_if &&
+            f->builtin != builtin_eval) {
+            result = lval_call(e, f, v);
+            lval_delete(f);
+            break;
+        }
+
+        /* the bytecode engine runs bodies and branches itself */
+        if (lisp_engine == LENGINE_VM) {
+            result = lval_call(e, f, v);
+            lval_delete(f);
+            break;
+        }
+
+        if (f->builtin) {
+            x = f->builtin == builtin_if ? lval_if_branch(v) : lval_eval_expr(v);
+            lval_delete(f);
+            if (LVAL_TYPE(x) == LVAL_ERR) {
+                result = x;
+                break;
+            }
+            v = lval_unshare(x);
+            v->type = LVAL_SEXPR;
+            continue;
+        }
+
+        result = lval_bind(e, f, v, &frame);
+        if (result) {
+            lval_delete(f);
+            break;
+        }
+
+        lframes_enter(&frames, &e, frame);
 
+        v = lval_unshare(lval_retain(f->body));
+        v->type = LVAL_SEXPR;
         lval_delete(f);
-        lval_delete(v);
-
-        return err;
     }
 
-    result = lval_call(e, f, v);
-
-    lval_delete(f);
+    lframes_release(&frames);
 
     return result;
 }
 
+/*
+ * Appends the shorter list onto the longer one's storage, so building a
+ * list one element at a time from either end is amortized O(1).
+ */
 lval *lval_join(lval *x, lval *y)
 {
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+    int append = x->count >= y->count;
+    lval *dst = append ? x : y;
+    lval *src = append ? y : x;
+    size_t n = src->count;
+    lval **to;
+
+    if (n == 0) {
+        lval_delete(src);
+        return dst;
     }
 
-    lval_delete(y);
+    dst = lval_unshare(dst);
 
-    return x;
+    if (append) {
+        lval_extend(dst, 0, n);
+        to = dst->cell + dst->count;
+        dst->cells->hi += n;
+    } else {
+        lval_extend(dst, n, 0);
+        dst->cells->lo -= n;
+        dst->cell -= n;
+        to = dst->cell;
+    }
+
+    memcpy(to, src->cell, sizeof(lval *) * n);
+    dst->count += n;
+
+    /* steal src's references if nobody else can see them */
+    if (src->refs == 1 && src->cells->refs == 1 &&
+        src->cell == src->cells->items + src->cells->lo &&
+        n == src->cells->hi - src->cells->lo) {
+        src->cells->hi = src->cells->lo;
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            lval_retain(to[i]);
+        }
+    }
+
+    lval_delete(src);
+
+    return dst;
 }
 
 int lval_eq(lval *x, lval *y)
 {
-    if (x->type != y->type) {
+    if (x == y) {
+        return 1;
+    }
+
+    if (LVAL_TYPE(x) != LVAL_TYPE(y)) {
         return 0;
     }
 
-    switch (x->type) {
+    switch (LVAL_TYPE(x)) {
     case LVAL_NUM:
-        return x->num == y->num;
+        return LVAL_NUMVAL(x) == LVAL_NUMVAL(y);
         break;
     case LVAL_ERR:
         return strcmp(x->err, y->err) == 0;
         break;
     case LVAL_SYM:
-        return strcmp(x->sym, y->sym) == 0;
+        return x->sym == y->sym;
         break;
     case LVAL_STR:
         return strcmp(x->str, y->str) == 0;
@@ -557,13 +1457,13 @@ int lval_eq(lval *x, lval *y)
 
 lval *lval_evaluate(lenv *e, lval *v)
 {
-    if (v->type == LVAL_SYM) {
+    if (LVAL_TYPE(v) == LVAL_SYM) {
         lval *x = lenv_get(e, v);
         lval_delete(v);
         return x;
     }
 
-    if (v->type == LVAL_SEXPR) {
+    if (LVAL_TYPE(v) == LVAL_SEXPR) {
         return lval_evaluate_sexpr(e, v);
     }
 
@@ -589,87 +1489,197 @@ void lval_println(lval *v)
     putchar('\n');
 }
 
-lval *builtin_op(lenv *e, lval *a, char *op)
+lval *builtin_op(lenv *e, lval *a, int op)
 {
-    lval *x;
+    long x;
 
     for (size_t i = 0; i < a->count; i++) {
-        if (a->cell[i]->type != LVAL_NUM) {
+        if (LVAL_TYPE(a->cell[i]) != LVAL_NUM) {
             lval_delete(a);
 
             return lval_err("Can't operate on non-number!");
         }
     }
 
-    x = lval_pop(a, 0);
+    x = LVAL_NUMVAL(a->cell[0]);
 
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        x->num = -(x->num);
+    if (op == LOP_SUB && a->count == 1) {
+        x = -x;
     }
 
-    while (a->count > 0) {
-        lval *y = lval_pop(a, 0);
+    for (size_t i = 1; i < a->count; i++) {
+        long y = LVAL_NUMVAL(a->cell[i]);
 
-        if (strcmp(op, "+") == 0) {
-            x->num += y->num;
+        if (op == LOP_DIV && y == 0) {
+            lval_delete(a);
+            return lval_err("Division by zero.");
         }
-        if (strcmp(op, "-") == 0) {
-            x->num -= y->num;
+        x = lop_apply(op, x, y);
+    }
+
+    lval_delete(a);
+
+    return lval_num(x);
+}
+
+/*
+ * Constant folding (`--fold`). Calls of pure builtins whose arguments
+ * are all literals are evaluated once and replaced by their value:
+ * in each loaded form just before it runs, and in each lambda body
+ * when `\` creates the lambda. Q-expressions are only searched where
+ * they hold code, as the arguments of `if` and `eval`; everywhere else
+ * they are data. Names are resolved at fold time, so later rebinding
+ * `+` doesn't reach code folded before. Calls that fail are left in
+ * place to fail at run time. A call whose head is a parameter of the
+ * lambda being created, or of a lambda running now, is left alone:
+ * the name means whatever the caller passes in.
+ */
+int lisp_fold;
+
+static int lval_is_literal(lval *v)
+{
+    int t = LVAL_TYPE(v);
+
+    return t == LVAL_NUM || t == LVAL_STR || t == LVAL_QEXPR;
+}
+
+static int lval_is_pure(lval *f, lval *a)
+{
+    if (LVAL_TYPE(f) != LVAL_FUN || !f->builtin) {
+        return 0;
+    }
+
+    /* leave `head {}` and `tail {}` to complain at run time */
+    if (f->builtin == builtin_head || f->builtin == builtin_tail) {
+        return a->count == 2 && LVAL_TYPE(a->cell[1]) == LVAL_QEXPR &&
+               a->cell[1]->count > 0;
+    }
+
+    return f->op != LOP_NONE || f->builtin == builtin_list ||
+           f->builtin == builtin_join;
+}
+
+static lval **lenv_find(lenv *e, char *sym);
+
+/* What k names for folding, or NULL if a parameter may rebind it */
+static lval *lval_fold_head(lenv *e, lval *formals, lval *k)
+{
+    for (size_t i = 0; formals && i < formals->count; i++) {
+        if (formals->cell[i]->sym == k->sym) {
+            return NULL;
         }
-        if (strcmp(op, "*") == 0) {
-            x->num *= y->num;
+    }
+
+    for (lenv *x = e; x && !x->global; x = x->par) {
+        if (lenv_find(x, k->sym)) {
+            return NULL;
         }
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_delete(x);
-                lval_delete(y);
-                x = lval_err("Division by zero.");
-                break;
-            }
-            x->num /= y->num;
+    }
+
+    return lenv_get(e, k);
+}
+
+/*
+ * Folds the calls in v, a call or a Q-expression of code. formals are
+ * the parameters of the lambda v is the body of, or NULL.
+ */
+lval *lval_fold(lenv *e, lval *formals, lval *v)
+{
+    lval *f = NULL;
+    lval *x;
+    int code = 0;
+    int pure;
+
+    if (v->count == 0) {
+        return v;
+    }
+
+    v = lval_unshare(v);
+    lval_own(v);
+
+    if (LVAL_TYPE(v->cell[0]) == LVAL_SYM) {
+        f = lval_fold_head(e, formals, v->cell[0]);
+        code = f && LVAL_TYPE(f) == LVAL_FUN &&
+               (f->builtin == builtin_if || f->builtin == builtin_eval);
+    }
+
+    for (size_t i = 0; i < v->count; i++) {
+        int t = LVAL_TYPE(v->cell[i]);
+
+        if (t == LVAL_SEXPR || (t == LVAL_QEXPR && code && i > 0)) {
+            v->cell[i] = lval_fold(e, formals, v->cell[i]);
         }
+    }
 
-        lval_delete(y);
+    pure = f && v->type == LVAL_SEXPR && lval_is_pure(f, v);
+    for (size_t i = 1; pure && i < v->count; i++) {
+        pure = lval_is_literal(v->cell[i]);
     }
 
-    lval_delete(a);
+    if (f) {
+        lval_delete(f);
+    }
+    if (!pure) {
+        return v;
+    }
+
+    x = lval_evaluate(e, lval_retain(v));
+    if (LVAL_TYPE(x) == LVAL_ERR) {
+        lval_delete(x);
+        return v;
+    }
+
+    lisp_stats.folded++;
+    lval_delete(v);
 
     return x;
 }
 
 lval *builtin_load(lenv *e, lval *a)
 {
-    mpc_result_t r;
+    lval *expr;
 
     LASSERT_NUM("load", a, 1);
     LASSERT_TYPE("load", a, 0, LVAL_STR);
 
-    if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-        lval *expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
+    expr = lcache_load(a->cell[0]->str);
+    if (LVAL_TYPE(expr) == LVAL_ERR) {
+        lval_delete(a);
+        return expr;
+    }
+
+    /* the forms are shared with the cache */
+    expr = lval_unshare(expr);
 
-        while (expr->count) {
-            lval *x = lval_evaluate(e, lval_pop(expr, 0));
-            if (x->type == LVAL_ERR) {
-                lval_println(x);
-            }
-            lval_delete(x);
+    if (lgc_enabled) {
+        lgc_push_root(a);
+        lgc_push_root(expr);
+    }
+
+    while (expr->count) {
+        lval *x = lval_pop(expr, 0);
+
+        /* fold each form as it comes, after the ones before ran */
+        if (lisp_fold && LVAL_TYPE(x) == LVAL_SEXPR) {
+            x = lval_fold(e, NULL, x);
         }
 
-        lval_delete(expr);
-        lval_delete(a);
-        
-        return lval_sexpr();
-    } else {
-        lval *err;
-        char *err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
-        err = lval_err("Could not load library %s", err_msg);
-        free(err_msg);
-        lval_delete(a);
+        x = lval_evaluate_toplevel(e, x);
+        if (LVAL_TYPE(x) == LVAL_ERR) {
+            lval_println(x);
+        }
+        lval_delete(x);
+    }
 
-        return err;
+    if (lgc_enabled) {
+        lgc_pop_root();
+        lgc_pop_root();
     }
+
+    lval_delete(expr);
+    lval_delete(a);
+
+    return lval_sexpr();
 }
 
 lval *builtin_print(lenv *e, lval *a)
@@ -698,63 +1708,49 @@ lval *builtin_error(lenv *e, lval *a)
 }
 
 
-lval *builtin_add(lenv *e, lval *a) { return builtin_op(e, a, "+"); }
+lval *builtin_add(lenv *e, lval *a) { return builtin_op(e, a, LOP_ADD); }
 
-lval *builtin_sub(lenv *e, lval *a) { return builtin_op(e, a, "-"); }
+lval *builtin_sub(lenv *e, lval *a) { return builtin_op(e, a, LOP_SUB); }
 
-lval *builtin_mul(lenv *e, lval *a) { return builtin_op(e, a, "*"); }
+lval *builtin_mul(lenv *e, lval *a) { return builtin_op(e, a, LOP_MUL); }
 
-lval *builtin_div(lenv *e, lval *a) { return builtin_op(e, a, "/"); }
+lval *builtin_div(lenv *e, lval *a) { return builtin_op(e, a, LOP_DIV); }
 
-lval *builtin_gt(lenv *e, lval *a) { return builtin_ord(e, a, ">"); }
+lval *builtin_gt(lenv *e, lval *a) { return builtin_ord(e, a, LOP_GT); }
 
-lval *builtin_lt(lenv *e, lval *a) { return builtin_ord(e, a, "<"); }
+lval *builtin_lt(lenv *e, lval *a) { return builtin_ord(e, a, LOP_LT); }
 
-lval *builtin_ge(lenv *e, lval *a) { return builtin_ord(e, a, ">="); }
+lval *builtin_ge(lenv *e, lval *a) { return builtin_ord(e, a, LOP_GE); }
 
-lval *builtin_le(lenv *e, lval *a) { return builtin_ord(e, a, "<="); }
+lval *builtin_le(lenv *e, lval *a) { return builtin_ord(e, a, LOP_LE); }
 
-lval *builtin_eq(lenv *e, lval *a) { return builtin_cmp(e, a, "=="); }
+lval *builtin_eq(lenv *e, lval *a) { return builtin_cmp(e, a, LOP_EQ); }
 
-lval *builtin_ne(lenv *e, lval *a) { return builtin_cmp(e, a, "!="); }
+lval *builtin_ne(lenv *e, lval *a) { return builtin_cmp(e, a, LOP_NE); }
 
-lval *builtin_ord(lenv *e, lval *a, char *op)
+lval *builtin_ord(lenv *e, lval *a, int op)
 {
     int r;
 
-    LASSERT_NUM(op, a, 2);
-    LASSERT_TYPE(op, a, 0, LVAL_NUM);
-    LASSERT_TYPE(op, a, 1, LVAL_NUM);
+    LASSERT_NUM(lop_name[op], a, 2);
+    LASSERT_TYPE(lop_name[op], a, 0, LVAL_NUM);
+    LASSERT_TYPE(lop_name[op], a, 1, LVAL_NUM);
 
-    if (strcmp(op, ">") == 0) {
-        r = a->cell[0]->num > a->cell[1]->num;
-    }
-    if (strcmp(op, "<") == 0) {
-        r = a->cell[0]->num < a->cell[1]->num;
-    }
-    if (strcmp(op, ">=") == 0) {
-        r = a->cell[0]->num >= a->cell[1]->num;
-    }
-    if (strcmp(op, "<=") == 0) {
-        r = a->cell[0]->num <= a->cell[1]->num;
-    }
+    r = lop_apply(op, LVAL_NUMVAL(a->cell[0]), LVAL_NUMVAL(a->cell[1]));
 
     lval_delete(a);
 
     return lval_num(r);
 }
 
-lval *builtin_cmp(lenv *e, lval *a, char *op)
+lval *builtin_cmp(lenv *e, lval *a, int op)
 {
     int r;
-    LASSERT_NUM(op, a, 2);
+    LASSERT_NUM(lop_name[op], a, 2);
 
-    if (strcmp(op, "==") == 0) {
-        r = lval_eq(a->cell[0], a->cell[1]);
-    }
-
-    if (strcmp(op, "!=") == 0) {
-        r = !lval_eq(a->cell[0], a->cell[1]);
+    r = lval_eq(a->cell[0], a->cell[1]);
+    if (op == LOP_NE) {
+        r = !r;
     }
 
     lval_delete(a);
@@ -762,7 +1758,8 @@ lval *builtin_cmp(lenv *e, lval *a, char *op)
     return lval_num(r);
 }
 
-lval *builtin_if(lenv *e, lval *a)
+/* Checks the arguments of `if` and returns the branch it takes */
+lval *lval_if_branch(lval *a)
 {
     lval *x;
 
@@ -771,18 +1768,29 @@ lval *builtin_if(lenv *e, lval *a)
     LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
     LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
 
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
+    x = lval_pop(a, LVAL_NUMVAL(a->cell[0]) ? 1 : 2);
+    lval_delete(a);
+
+    return x;
+}
 
-    if (a->cell[0]->num) {
-        x = lval_evaluate(e, lval_pop(a, 1));
-    } else {
-        x = lval_evaluate(e, lval_pop(a, 2));
+lval *builtin_if(lenv *e, lval *a)
+{
+    lval *x = lval_if_branch(a);
+
+    if (LVAL_TYPE(x) == LVAL_ERR) {
+        return x;
     }
 
-    lval_delete(a);
+    /* branches are shared with the code that holds them, keep them intact */
+    if (lisp_engine == LENGINE_VM) {
+        return lvm_evaluate(e, x);
+    }
 
-    return x;
+    x = lval_unshare(x);
+    x->type = LVAL_SEXPR;
+
+    return lval_evaluate(e, x);
 }
 
 lval *builtin_head(lenv *e, lval *a)
@@ -793,16 +1801,18 @@ lval *builtin_head(lenv *e, lval *a)
             "Function 'head' passed too many arguments: "
             "got %i, expected %i.",
             a->count, 1);
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+    LASSERT(a, LVAL_TYPE(a->cell[0]) == LVAL_QEXPR,
             "Function 'head' passed incorrect type"
             "Got %s, expected %s.",
-            ltype_name(a->cell[0]->type), ltype_name(LVAL_SEXPR));
+            ltype_name(LVAL_TYPE(a->cell[0])), ltype_name(LVAL_SEXPR));
     LASSERT(a, a->count == 1, "Function 'head' passed {}");
 
     v = lval_take(a, 0);
 
-    while (v->count > 1) {
-        lval_delete(lval_pop(v, 1));
+    if (v->count > 1) {
+        lval *x = lval_add(lval_qexpr(), lval_retain(v->cell[0]));
+        lval_delete(v);
+        return x;
     }
 
     return v;
@@ -816,13 +1826,13 @@ lval *builtin_tail(lenv *e, lval *a)
             "Function 'tail' passed too many arguments: "
             "got %i, expected %i.",
             a->count, 1);
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+    LASSERT(a, LVAL_TYPE(a->cell[0]) == LVAL_QEXPR,
             "Function 'tail' passed incorrect type"
             "Got %s, expected %s.",
-            ltype_name(a->cell[0]->type), ltype_name(LVAL_SEXPR));
+            ltype_name(LVAL_TYPE(a->cell[0])), ltype_name(LVAL_SEXPR));
     LASSERT(a, a->count == 1, "Function 'tail' passed {}");
 
-    v = lval_take(a, 0);
+    v = lval_unshare(lval_take(a, 0));
 
     lval_delete(lval_pop(v, 0));
 
@@ -836,20 +1846,34 @@ lval *builtin_list(lenv *e, lval *a)
     return a;
 }
 
-lval *builtin_eval(lenv *e, lval *a)
+/* Checks the argument of `eval` and returns the expression */
+lval *lval_eval_expr(lval *a)
 {
-    lval *x;
-
     LASSERT(a, a->count == 1,
             "Function 'eval' passed too many arguments: "
             "got %i, expected %i.",
             a->count, 1);
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+    LASSERT(a, LVAL_TYPE(a->cell[0]) == LVAL_QEXPR,
             "Function 'eval' passed incorrect type"
             "Got %s, expected %s.",
-            ltype_name(a->cell[0]->type), ltype_name(LVAL_SEXPR));
+            ltype_name(LVAL_TYPE(a->cell[0])), ltype_name(LVAL_SEXPR));
+
+    return lval_take(a, 0);
+}
+
+lval *builtin_eval(lenv *e, lval *a)
+{
+    lval *x = lval_eval_expr(a);
+
+    if (LVAL_TYPE(x) == LVAL_ERR) {
+        return x;
+    }
 
-    x = lval_take(a, 0);
+    if (lisp_engine == LENGINE_VM) {
+        return lvm_evaluate(e, x);
+    }
+
+    x = lval_unshare(x);
     x->type = LVAL_SEXPR;
 
     return lval_evaluate(e, x);
@@ -859,10 +1883,10 @@ lval *builtin_join(lenv *e, lval *a)
 {
     lval *x;
     for (size_t i = 0; i < a->count; i++) {
-        LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
+        LASSERT(a, LVAL_TYPE(a->cell[i]) == LVAL_QEXPR,
                 "Function 'join' passed incorrect type"
                 "Got %s, expected %s.",
-                ltype_name(a->cell[0]->type), ltype_name(LVAL_SEXPR));
+                ltype_name(LVAL_TYPE(a->cell[0])), ltype_name(LVAL_SEXPR));
     }
 
     x = lval_pop(a, 0);
@@ -883,10 +1907,11 @@ lval *builtin_var(lenv *e, lval *a, char *func)
     LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
 
     for (size_t i = 0; i < syms->count; i++) {
-        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+        LASSERT(a, (LVAL_TYPE(syms->cell[i]) == LVAL_SYM),
                 "Function '%s' can't define non-symbol: "
                 "got %s, expected %s.",
-                func, ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+                func, ltype_name(LVAL_TYPE(syms->cell[i])),
+                ltype_name(LVAL_SYM));
     }
 
     LASSERT(a, (syms->count == a->count - 1),
@@ -913,6 +1938,60 @@ lval *builtin_def(lenv *e, lval *a) { return builtin_var(e, a, "def"); }
 
 lval *builtin_put(lenv *e, lval *a) { return builtin_var(e, a, "="); }
 
+/* 1 + the frame slot lval_bind puts parameter sym in, or 0 */
+static size_t lval_param_slot(lval *formals, char *sym)
+{
+    size_t slot = 0;
+    char *amp = lsym_intern("&");
+
+    for (size_t i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->sym == amp) {
+            continue;
+        }
+        slot++;
+        if (formals->cell[i]->sym == sym) {
+            return slot;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Records in every symbol of body naming one of formals the frame slot
+ * lval_bind puts that parameter in, so lenv_get can read it without a
+ * search. Scoping is dynamic, so only the running lambda's own frame is
+ * known in advance; other names keep going through lenv_get. Symbols
+ * are shared, which makes the slot a hint that lenv_get checks first.
+ */
+static void lval_resolve(lval *formals, lval *body)
+{
+    char *lambda = lsym_intern("\\");
+
+    for (size_t i = 0; i < body->count; i++) {
+        lval *x = body->cell[i];
+        size_t slot;
+
+        switch (LVAL_TYPE(x)) {
+        case LVAL_SYM:
+            slot = lval_param_slot(formals, x->sym);
+            if (slot) {
+                x->slot = slot;
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            /* nested lambdas resolve their own bodies */
+            if (x->count && LVAL_TYPE(x->cell[0]) == LVAL_SYM &&
+                x->cell[0]->sym == lambda) {
+                break;
+            }
+            lval_resolve(formals, x);
+            break;
+        }
+    }
+}
+
 lval *builtin_lambda(lenv *e, lval *a)
 {
     lval *formals;
@@ -923,118 +2002,288 @@ lval *builtin_lambda(lenv *e, lval *a)
     LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
 
     for (size_t i = 0; i < a->cell[0]->count; i++) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+        LASSERT(a, (LVAL_TYPE(a->cell[0]->cell[i]) == LVAL_SYM),
                 "Can't define non-symbol: got %s, expected %s.",
-                ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+                ltype_name(LVAL_TYPE(a->cell[0]->cell[i])),
+                ltype_name(LVAL_SYM));
     }
 
     formals = lval_pop(a, 0);
     body = lval_pop(a, 0);
     lval_delete(a);
 
+    if (lisp_fold) {
+        body = lval_fold(e, formals, body);
+    }
+    lval_resolve(formals, body);
+
     return lval_lambda(formals, body);
 }
 
-lval *builtin(lenv *e, lval *a, char *func)
+lenv *lenv_new(void)
 {
-    if (strcmp("list", func) == 0) {
-        return builtin_list(e, a);
-    }
-    if (strcmp("head", func) == 0) {
-        return builtin_head(e, a);
+    lenv *e = lslab_alloc(&lenv_slab);
+
+    lisp_stats.lenv_allocs++;
+
+    e->par = NULL;
+    e->mark = 0;
+    e->frame = 0;
+    e->linear = 0;
+    e->global = 0;
+    e->refs = 1;
+    e->count = 0;
+    e->cap = 0;
+    e->syms = NULL;
+    e->vals = NULL;
+
+    return e;
+}
+
+/* An empty call frame; its slots are recycled from a free list */
+lenv *lenv_frame(lenv *par)
+{
+    lenv *e = lenv_new();
+    void **slots = lslab_alloc(&lslot_slab);
+
+    e->par = par;
+    e->frame = 1;
+    e->linear = 1;
+    e->cap = LENV_FRAME_SLOTS;
+    e->syms = (char **)slots;
+    e->vals = (lval **)(slots + LENV_FRAME_SLOTS);
+    memset(e->syms, 0, sizeof(char *) * LENV_FRAME_SLOTS);
+
+    return e;
+}
+
+static void lenv_free_slots(lenv *e)
+{
+    if (e->linear) {
+        lslab_free(&lslot_slab, e->syms);
+    } else {
+        free(e->syms);
+        free(e->vals);
     }
-    if (strcmp("tail", func) == 0) {
-        return builtin_tail(e, a);
+}
+
+/*
+ * Changes whenever a global is bound or rebound, or the global
+ * environment goes away. Frames that shadow a global don't move it:
+ * lenv_get_head ignores its cache while the name has any locals.
+ * Starts at 1 so that a fresh symbol's version of 0 never matches.
+ */
+size_t lenv_version = 1;
+
+/* Takes e's bindings out of the symbols' frame counts and global cells */
+static void lenv_unbind(lenv *e)
+{
+    if (e->global) {
+        lenv_version++;
     }
-    if (strcmp("join", func) == 0) {
-        return builtin_join(e, a);
+
+    for (size_t i = 0; i < e->cap; i++) {
+        if (!e->syms[i]) {
+            continue;
+        }
+        if (e->frame) {
+            LSYM(e->syms[i])->locals--;
+        } else if (e->global && LSYM(e->syms[i])->global == e->vals[i]) {
+            LSYM(e->syms[i])->global = NULL;
+        }
     }
-    if (strcmp("eval", func) == 0) {
-        return builtin_eval(e, a);
+}
+
+void lenv_delete(lenv *e)
+{
+    if (--e->refs > 0) {
+        return;
     }
 
-    if (strstr("+-*/", func)) {
-        return builtin_op(e, a, func);
+    lenv_unbind(e);
+    for (size_t i = 0; i < e->cap; i++) {
+        if (e->syms[i]) {
+            lval_delete(e->vals[i]);
+        }
     }
+    lenv_free_slots(e);
+    lslab_free(&lenv_slab, e);
+}
 
-    lval_delete(a);
+/* keys are interned, so hashing the address is enough */
+static size_t lenv_hash(char *sym)
+{
+    size_t h = (size_t)sym;
 
-    return lval_err("Unknown function");
+    return (h >> 4) ^ (h >> 12);
 }
 
-lenv *lenv_new(void)
+/*
+ * Returns the slot holding sym, or the empty slot where it would be
+ * inserted. The table is never full, so probing always terminates.
+ */
+static size_t lenv_slot(lenv *e, char *sym)
 {
-    lenv *e = malloc(sizeof(lenv));
+    size_t mask = e->cap - 1;
+    size_t i = lenv_hash(sym) & mask;
 
-    e->par = NULL;
-    e->count = 0;
-    e->syms = NULL;
-    e->vals = NULL;
+    while (e->syms[i] && e->syms[i] != sym) {
+        i = (i + 1) & mask;
+    }
 
-    return e;
+    return i;
 }
 
-void lenv_delete(lenv *e)
+static void lenv_grow(lenv *e)
+{
+    lenv old = *e;
+
+    /* a frame that fills up moves its bindings into a table */
+    e->cap = old.linear ? 2 * LENV_FRAME_SLOTS
+                        : (old.cap ? old.cap * 2 : LENV_MIN_CAP);
+    e->linear = 0;
+    e->syms = calloc(e->cap, sizeof(char *));
+    e->vals = calloc(e->cap, sizeof(lval *));
+
+    for (size_t i = 0; i < old.cap; i++) {
+        if (old.syms[i]) {
+            size_t j = lenv_slot(e, old.syms[i]);
+            e->syms[j] = old.syms[i];
+            e->vals[j] = old.vals[i];
+        }
+    }
+
+    lenv_free_slots(&old);
+}
+
+/* Returns the value slot bound to sym in e itself, or NULL */
+static lval **lenv_find(lenv *e, char *sym)
 {
-    for (size_t i = 0; i < e->count; i++) {
-        free(e->syms[i]);
-        lval_delete(e->vals[i]);
+    size_t i;
+
+    if (e->linear) {
+        for (i = 0; i < e->count; i++) {
+            if (e->syms[i] == sym) {
+                return &e->vals[i];
+            }
+        }
+        return NULL;
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
+
+    if (e->count == 0) {
+        return NULL;
+    }
+
+    i = lenv_slot(e, sym);
+
+    return e->syms[i] ? &e->vals[i] : NULL;
 }
 
 lval *lenv_get(lenv *e, lval *k)
 {
-    for (size_t i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+    lsym *s = LSYM(k->sym);
+
+    /* a parameter of the running lambda, where lval_resolve expects it */
+    if (k->slot && e->linear && k->slot <= e->count &&
+        e->syms[k->slot - 1] == k->sym) {
+        return lval_retain(e->vals[k->slot - 1]);
+    }
+
+    if (!s->locals && s->global) {
+        return lval_retain(s->global);
+    }
+
+    for (; e; e = e->par) {
+        lval **v = lenv_find(e, k->sym);
+        if (v) {
+            return lval_retain(*v);
         }
     }
 
-    if (e->par) {
-        return lenv_get(e->par, k);
-    } else {
-        return lval_err("Unbound symbol '%s'", k->sym);
+    return lval_err("Unbound symbol '%s'", k->sym);
+}
+
+/*
+ * lenv_get for the head of a call. Each call site keeps the global its
+ * head last resolved to and reuses it until lenv_version moves on, and
+ * only while no frame binds the name. The cached value is borrowed: the
+ * global environment holds it for as long as the version stays the same.
+ */
+lval *lenv_get_head(lenv *e, lval *k)
+{
+    lsym *s = LSYM(k->sym);
+    lval *x;
+
+    if (k->version == lenv_version && !s->locals) {
+        return lval_retain(k->target);
+    }
+
+    x = lenv_get(e, k);
+
+    if (!s->locals && x == s->global) {
+        k->version = lenv_version;
+        k->target = x;
     }
+
+    return x;
 }
 
-lenv *lenv_copy(lenv *e)
+/* Whether every name bound in x is also bound in e itself */
+int lenv_shadows(lenv *e, lenv *x)
 {
-    lenv *n = malloc(sizeof(lenv));
-    n->par = e->par;
-    n->count = e->count;
-    n->syms = malloc(sizeof(char *) * n->count);
-    n->vals = malloc(sizeof(lval *) * n->count);
+    if (x->count > e->count) {
+        return 0;
+    }
 
-    for (size_t i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+    for (size_t i = 0; i < x->cap; i++) {
+        if (x->syms[i] && !lenv_find(e, x->syms[i])) {
+            return 0;
+        }
     }
 
-    return n;
+    return 1;
+}
+
+lenv *lenv_retain(lenv *e)
+{
+    e->refs++;
+    return e;
 }
 
 void lenv_put(lenv *e, lval *k, lval *v)
 {
-    for (size_t i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_delete(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
-        }
+    lval **slot = lenv_find(e, k->sym);
+    size_t i;
+
+    if (e->global) {
+        LSYM(k->sym)->global = v;
+        lenv_version++;
     }
 
-    /* if no existing entry found allocate space for new entry */
-    e->count++;
-    e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-    e->syms = realloc(e->syms, sizeof(char *) * e->count);
+    if (slot) {
+        lval_retain(v);
+        lval_delete(*slot);
+        *slot = v;
+        return;
+    }
+
+    /* frames append in order, tables keep the load factor at or below 3/4 */
+    if (e->linear && e->count == e->cap) {
+        lenv_grow(e);
+    } else if (!e->linear && (e->count + 1) * 4 > e->cap * 3) {
+        lenv_grow(e);
+    }
 
-    e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count - 1], k->sym);
+    i = e->linear ? e->count : lenv_slot(e, k->sym);
+
+    if (e->frame) {
+        LSYM(k->sym)->locals++;
+    }
+
+    /* claim the empty slot */
+    e->count++;
+    e->vals[i] = lval_retain(v);
+    e->syms[i] = k->sym;
 }
 
 void lenv_def(lenv *e, lval *k, lval *v)
@@ -1055,31 +2304,64 @@ void lenv_add_builtin(lenv *e, char *name, lbuiltin func)
     lval_delete(v);
 }
 
+/* every builtin under its global name, in the order they are bound */
+static struct {
+    char *name;
+    lbuiltin func;
+} lbuiltins[] = {
+    {"list", builtin_list},
+    {"head", builtin_head},
+    {"tail", builtin_tail},
+    {"eval", builtin_eval},
+    {"join", builtin_join},
+    {"def", builtin_def},
+    {"load", builtin_load},
+    {"error", builtin_error},
+    {"print", builtin_print},
+
+    {"+", builtin_add},
+    {"-", builtin_sub},
+    {"*", builtin_mul},
+    {"/", builtin_div},
+    {"=", builtin_put},
+
+    {"if", builtin_if},
+    {"==", builtin_eq},
+    {"!=", builtin_ne},
+    {">", builtin_gt},
+    {"<", builtin_lt},
+    {">=", builtin_ge},
+    {"<=", builtin_le},
+
+    {"\\", builtin_lambda},
+};
+
+#define LBUILTINS_COUNT (sizeof(lbuiltins) / sizeof(lbuiltins[0]))
+
 void lenv_add_builtins(lenv *e)
 {
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
-    lenv_add_builtin(e, "def", builtin_def);
-    lenv_add_builtin(e, "load", builtin_load);
-    lenv_add_builtin(e, "error", builtin_error);
-    lenv_add_builtin(e, "print", builtin_print);
-
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
-    lenv_add_builtin(e, "=", builtin_put);
-
-    lenv_add_builtin(e, "if", builtin_if);
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_ne);
-    lenv_add_builtin(e, ">", builtin_gt);
-    lenv_add_builtin(e, "<", builtin_lt);
-    lenv_add_builtin(e, ">=", builtin_ge);
-    lenv_add_builtin(e, "<=", builtin_le);
-
-    lenv_add_builtin(e, "\\", builtin_lambda);
+    for (size_t i = 0; i < LBUILTINS_COUNT; i++) {
+        lenv_add_builtin(e, lbuiltins[i].name, lbuiltins[i].func);
+    }
+}
+
+/* The name func is bound to by lenv_add_builtins, for images */
+char *lbuiltin_name(lbuiltin func)
+{
+    for (size_t i = 0; i < LBUILTINS_COUNT; i++) {
+        if (lbuiltins[i].func == func) {
+            return lbuiltins[i].name;
+        }
+    }
+    return NULL;
+}
+
+lbuiltin lbuiltin_find(char *name)
+{
+    for (size_t i = 0; i < LBUILTINS_COUNT; i++) {
+        if (strcmp(lbuiltins[i].name, name) == 0) {
+            return lbuiltins[i].func;
+        }
+    }
+    return NULL;
 }
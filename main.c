@@ -1,5 +1,6 @@
 #include "mpc.h"
 #include "lisp.h"
+#include <time.h>
 
 #ifdef _WIN32
 
@@ -26,75 +27,138 @@ void add_history(char *unused) {}
 
 int main(int argc, char **argv)
 {
-    Number = mpc_new("number");
-    Symbol = mpc_new("symbol");
-    Comment = mpc_new("comment");
-    Sexpr = mpc_new("sexpr");
-    Qexpr = mpc_new("qexpr");
-    String = mpc_new("string");
-    Expr = mpc_new("expr");
-    Lispy = mpc_new("lispy");
     lenv *e;
+    int files = 0;
+    int stats = 0;
+    char *image = NULL;
+    char *dump = NULL;
+    int read_bench = 0;
+    clock_t start = clock();
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "--gc") == 0) {
+            lgc_enabled = 1;
+        } else if (strcmp(argv[i], "--fold") == 0) {
+            lisp_fold = 1;
+        } else if (strcmp(argv[i], "--engine=vm") == 0) {
+            lisp_engine = LENGINE_VM;
+        } else if (strcmp(argv[i], "--engine=tree") == 0) {
+            lisp_engine = LENGINE_TREE;
+        } else if (strncmp(argv[i], "--parse-cache=", 14) == 0) {
+            if (argv[i][14] == '\0') {
+                fprintf(stderr, "Error: --parse-cache needs a directory\n");
+                return 1;
+            }
+            lcache_dir = argv[i] + 14;
+        } else if (strncmp(argv[i], "--image=", 8) == 0) {
+            image = argv[i] + 8;
+        } else if (strncmp(argv[i], "--dump-image=", 13) == 0) {
+            dump = argv[i] + 13;
+        } else if (strcmp(argv[i], "--reader=mpc") == 0) {
+            lisp_reader = LREADER_MPC;
+        } else if (strcmp(argv[i], "--reader=direct") == 0) {
+            lisp_reader = LREADER_DIRECT;
+        } else if (strcmp(argv[i], "--packrat") == 0) {
+            lisp_packrat = 1;
+        } else if (strcmp(argv[i], "--read-bench") == 0) {
+            read_bench = 1;
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            fprintf(stderr, "Usage: %s [--option ...] [file ...]\n",
+                    argv[0]);
+            return 1;
+        } else {
+            files++;
+        }
+    }
+
+    if (image) {
+        e = limg_load(image);
+        if (!e) {
+            fprintf(stderr, "Error: Could not load image %s\n", image);
+            return 1;
+        }
+    } else {
+        e = lenv_new();
+        e->global = 1;
+        lenv_add_builtins(e);
+    }
 
-    mpca_lang(MPCA_LANG_DEFAULT, 
-            "                                                               \
-                number: /-?[0-9]+/;                                         \
-                symbol: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;                   \
-                string: /\"(\\\\.|[^\"])*\"/;                               \
-                comment: /;[^\\r\\n]*/;                                     \
-                sexpr: '(' <expr>* ')';                                     \
-                qexpr: '{' <expr>* '}';                                     \
-                expr: <number> | <symbol> | <sexpr>                         \
-                    | <qexpr>  | <string> | <comment>;                      \
-                lispy: /^/ <expr>* /$/;                                     \
-            ",
-              Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
-
-    (void)argc;
-    (void)argv;
-
-    e = lenv_new();
-    lenv_add_builtins(e);
-
-    if (argc == 1) {
+    if (files == 0 && !dump) {
         puts("Lispy version 0.0.1");
         puts("CTRL+C to exit\n");
 
         while (1) {
-            mpc_result_t result;
             char *input = readline("lispy> ");
+            lval *x;
 
             add_history(input);
 
-            if (mpc_parse("<stdin>", input, Lispy, &result)) {
-                lval *x = lval_evaluate(e, lval_read(result.output));
-                lval_println(x);
-                lval_delete(x);
-                mpc_ast_delete(result.output);
-            } else {
-                mpc_err_print(result.error);
-                mpc_err_delete(result.error);
-            }
+            /* a parse error evaluates to itself */
+            x = lisp_reader == LREADER_MPC ? lread_mpc("<stdin>", input)
+                                           : lread("<stdin>", input);
+            x = lval_evaluate_toplevel(e, x);
+            lval_println(x);
+            lval_delete(x);
 
             free(input);
         }
     }
 
-    if (argc >= 2) {
-        for (int i = 1; i < argc; i++) {
-            lval *args = lval_add(lval_sexpr(), lval_str(argv[i]));
-            lval *x = builtin_load(e, args);
-            if (x->type == LVAL_ERR) {
-                lval_println(x);
-            }
-            lval_delete(x);
+    for (int i = 1; i < argc; i++) {
+        lval *args;
+        lval *x;
+
+        if (argv[i][0] == '-' && argv[i][1] == '-') {
+            continue;
         }
+        if (read_bench) {
+            lread_bench(argv[i]);
+            continue;
+        }
+
+        args = lval_add(lval_sexpr(), lval_str(argv[i]));
+        x = builtin_load(e, args);
+        if (LVAL_TYPE(x) == LVAL_ERR) {
+            lval_println(x);
+        }
+        lval_delete(x);
     }
 
-    lenv_delete(e);
+    if (dump && !limg_dump(e, dump)) {
+        fprintf(stderr, "Error: Could not write image %s\n", dump);
+    }
 
-    mpc_cleanup(8, Number, Symbol, Sexpr, Qexpr,
-                String, Comment, Expr, Lispy);
+    lenv_delete(e);
+    lisp_cleanup();
+
+    if (stats) {
+        fprintf(stderr, "engine: %s, %.3f s\n",
+                lisp_engine == LENGINE_VM ? "vm" : "tree",
+                (double)(clock() - start) / CLOCKS_PER_SEC);
+        fprintf(stderr, "lval allocations: %zu\n", lisp_stats.lval_allocs);
+        fprintf(stderr, "lenv allocations: %zu\n", lisp_stats.lenv_allocs);
+        if (lisp_fold) {
+            fprintf(stderr, "folded: %zu calls\n", lisp_stats.folded);
+        }
+        fprintf(stderr, "parse cache: %zu hits, %zu parses\n",
+                lisp_stats.load_hits, lisp_stats.load_parses);
+        if (lisp_packrat) {
+            fprintf(stderr, "packrat: %zu hits of %zu lookups\n",
+                    lisp_stats.packrat_hits, lisp_stats.packrat_lookups);
+        }
+        if (lgc_enabled) {
+            fprintf(stderr, "gc runs: %zu, reclaimed: %zu objects\n",
+                    lisp_stats.gc_runs, lisp_stats.gc_reclaimed);
+            fprintf(stderr, "gc pause: %.3f ms total, %.3f ms max\n",
+                    lisp_stats.gc_pause_total * 1000,
+                    lisp_stats.gc_pause_max * 1000);
+            fprintf(stderr, "heap: %zu bytes, %zu live objects\n",
+                    lisp_stats.heap_bytes, lisp_stats.heap_live);
+        }
+    }
 
     return 0;
 }
@@ -60,7 +60,6 @@ static mpc_state_t mpc_state_new(void) {
 
 enum {
   MPC_INPUT_STRING = 0,
-  MPC_INPUT_FILE   = 1,
   MPC_INPUT_PIPE   = 2
 };
 
@@ -76,18 +75,39 @@ typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+/* what a packrat parser did at one position, see mpc_parse_memo */
+typedef struct {
+  mpc_parser_t *p;
+  long pos;
+  int flags;
+  int ok;
+  mpc_state_t state;
+  char last;
+  mpc_val_t *output;
+  mpc_err_t *error;
+  mpc_err_t *errors;
+} mpc_memo_t;
+
 typedef struct {
 
   int type;
   char *filename;
   mpc_state_t state;
 
-  char *string;
+  /* string inputs borrow the caller's text unless owned is set */
+  const char *string;
+  size_t length;
+  int owned;
+
+  /* what a pipe input read since its first mark, see mpc_input_success */
   char *buffer;
+  size_t buffer_len;
+  size_t buffer_cap;
   FILE *file;
 
   int suppress;
   int backtrack;
+  int regexes; /* 1 once a compiled regex has run, -1 to use the trees instead */
   size_t marks_slots;
   size_t marks_num;
   mpc_state_t *marks;
@@ -95,6 +115,13 @@ typedef struct {
   char *lasts;
   char last;
 
+  /* packrat results, found through memo_table, which holds index + 1 */
+  mpc_memo_t *memo;
+  size_t memo_num;
+  size_t memo_cap;
+  size_t *memo_table;
+  size_t memo_slots;
+
   size_t mem_index;
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
@@ -111,13 +138,22 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
 
   i->state = mpc_state_new();
 
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = string;
+  i->length = strlen(string);
+  i->owned = 0;
   i->buffer = NULL;
+  i->buffer_len = 0;
+  i->buffer_cap = 0;
   i->file = NULL;
 
   i->suppress = 0;
   i->backtrack = 1;
+  i->regexes = 0;
+  i->memo = NULL;
+  i->memo_num = 0;
+  i->memo_cap = 0;
+  i->memo_table = NULL;
+  i->memo_slots = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
@@ -140,14 +176,22 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
 
   i->state = mpc_state_new();
 
-  i->string = malloc(length + 1);
-  strncpy(i->string, string, length);
-  i->string[length] = '\0';
+  i->string = string;
+  i->length = length;
+  i->owned = 0;
   i->buffer = NULL;
+  i->buffer_len = 0;
+  i->buffer_cap = 0;
   i->file = NULL;
 
   i->suppress = 0;
   i->backtrack = 1;
+  i->regexes = 0;
+  i->memo = NULL;
+  i->memo_num = 0;
+  i->memo_cap = 0;
+  i->memo_table = NULL;
+  i->memo_slots = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
@@ -172,11 +216,21 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
 
   i->string = NULL;
+  i->length = 0;
+  i->owned = 0;
   i->buffer = NULL;
+  i->buffer_len = 0;
+  i->buffer_cap = 0;
   i->file = pipe;
 
   i->suppress = 0;
   i->backtrack = 1;
+  i->regexes = 0;
+  i->memo = NULL;
+  i->memo_num = 0;
+  i->memo_cap = 0;
+  i->memo_table = NULL;
+  i->memo_slots = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
@@ -190,21 +244,86 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
 }
 
+/*
+** Files are read into memory up front and parsed as strings. Reading
+** them through stdio cost an fgetc per character, plus an fseek on every
+** peek, failure and rewind. mpc_read_file returns the rest of file,
+** NUL-terminated, or NULL if it can't be read.
+*/
+char *mpc_read_file(FILE *file, size_t *length) {
+
+  size_t cap = 4096;
+  size_t len = 0;
+  size_t n;
+  long start = ftell(file);
+  long end;
+  char *buffer;
+  char *more;
+
+  /* regular files are read in one go, anything else in growing chunks */
+  if (start >= 0 && fseek(file, 0, SEEK_END) == 0) {
+    end = ftell(file);
+    if (end >= start) { cap = (size_t)(end - start) + 1; }
+    fseek(file, start, SEEK_SET);
+  }
+
+  buffer = malloc(cap);
+  if (buffer == NULL) { return NULL; }
+
+  while ((n = fread(buffer + len, 1, cap - len - 1, file)) > 0) {
+    len += n;
+    if (len + 1 == cap) {
+      /* a full buffer only grows if there is more to come */
+      int c = fgetc(file);
+      if (c == EOF) { break; }
+      more = realloc(buffer, cap * 2);
+      if (more == NULL) { free(buffer); return NULL; }
+      buffer = more;
+      cap *= 2;
+      buffer[len++] = (char)c;
+    }
+  }
+
+  if (ferror(file)) {
+    free(buffer);
+    return NULL;
+  }
+
+  buffer[len] = '\0';
+  *length = len;
+  return buffer;
+}
+
 static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
 
   i->filename = malloc(strlen(filename) + 1);
   strcpy(i->filename, filename);
-  i->type = MPC_INPUT_FILE;
+  i->type = MPC_INPUT_STRING;
   i->state = mpc_state_new();
 
-  i->string = NULL;
+  i->string = mpc_read_file(file, &i->length);
+
+  /* an unreadable file parses as an empty one */
+  if (i->string == NULL) {
+    i->string = calloc(1, 1);
+    i->length = 0;
+  }
+  i->owned = 1;
   i->buffer = NULL;
-  i->file = file;
+  i->buffer_len = 0;
+  i->buffer_cap = 0;
+  i->file = NULL;
 
   i->suppress = 0;
   i->backtrack = 1;
+  i->regexes = 0;
+  i->memo = NULL;
+  i->memo_num = 0;
+  i->memo_cap = 0;
+  i->memo_table = NULL;
+  i->memo_slots = 0;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
   i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
@@ -217,11 +336,14 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   return i;
 }
 
+static void mpc_input_memo_clear(mpc_input_t *i);
+
 static void mpc_input_delete(mpc_input_t *i) {
 
+  mpc_input_memo_clear(i);
   free(i->filename);
 
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
+  if (i->owned) { free((char*)i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
 
   free(i->marks);
@@ -315,13 +437,15 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->lasts[i->marks_num-1] = i->last;
 
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+    i->buffer_cap = 64;
+    i->buffer_len = 0;
+    i->buffer = malloc(i->buffer_cap);
   }
 
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
+  size_t j;
 
   if (i->backtrack < 1) { return; }
 
@@ -337,11 +461,13 @@ static void mpc_input_unmark(mpc_input_t *i) {
   }
 
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = (int)strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
+    for (j = i->buffer_len; j > 0; j--)
+      ungetc(i->buffer[j-1], i->file);
 
     free(i->buffer);
     i->buffer = NULL;
+    i->buffer_len = 0;
+    i->buffer_cap = 0;
   }
 
 }
@@ -353,29 +479,29 @@ static void mpc_input_rewind(mpc_input_t *i) {
   i->state = i->marks[i->marks_num-1];
   i->last  = i->lasts[i->marks_num-1];
 
-  if (i->type == MPC_INPUT_FILE) {
-    fseek(i->file, i->state.pos, SEEK_SET);
-  }
-
   mpc_input_unmark(i);
 }
 
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < (long)i->buffer_len + i->marks[0].pos;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
   return i->buffer[i->state.pos - i->marks[0].pos];
 }
 
+/* the end of an nstring input reads as NUL, like the end of a string */
+static char mpc_input_string_get(mpc_input_t *i) {
+  return (size_t)i->state.pos < i->length ? i->string[i->state.pos] : '\0';
+}
+
 static char mpc_input_getc(mpc_input_t *i) {
 
   char c = '\0';
 
   switch (i->type) {
 
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE: c = fgetc(i->file); return c;
+    case MPC_INPUT_STRING: return mpc_input_string_get(i);
     case MPC_INPUT_PIPE:
 
       if (!i->buffer) { c = getc(i->file); return c; }
@@ -397,15 +523,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
 
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE:
-
-      c = fgetc(i->file);
-      if (feof(i->file)) { return '\0'; }
-
-      fseek(i->file, -1, SEEK_CUR);
-      return c;
-
+    case MPC_INPUT_STRING: return mpc_input_string_get(i);
     case MPC_INPUT_PIPE:
 
       if (!i->buffer) {
@@ -437,7 +555,6 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
   switch (i->type) {
     case MPC_INPUT_STRING: { break; }
-    case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
     case MPC_INPUT_PIPE: {
 
       if (!i->buffer) { ungetc(c, i->file); break; }
@@ -457,9 +574,12 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
   if (i->type == MPC_INPUT_PIPE
   &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+    /* doubling keeps appends amortized O(1), and NULs are kept too */
+    if (i->buffer_len == i->buffer_cap) {
+      i->buffer_cap *= 2;
+      i->buffer = realloc(i->buffer, i->buffer_cap);
+    }
+    i->buffer[i->buffer_len++] = c;
   }
 
   i->last = c;
@@ -917,9 +1037,14 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_REGEX      = 29,
+  MPC_TYPE_PACKRAT    = 30
 };
 
+typedef struct mpc_match_t mpc_match_t;
+
 typedef struct { char *m; } mpc_pdata_fail_t;
 typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
 typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
@@ -937,6 +1062,8 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_match_t *m; } mpc_pdata_regex_t;
+typedef struct { mpc_parser_t *x; mpc_copy_t copy; mpc_dtor_t dtor; long lookups; long hits; } mpc_pdata_packrat_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -956,6 +1083,8 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_regex_t regex;
+  mpc_pdata_packrat_t packrat;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -1035,6 +1164,488 @@ static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   d(mpc_export(i, x));
 }
 
+/*
+** Regex Matcher
+**
+** The parser mpc_re_mode builds for a regex is also compiled, where it
+** can be, into a matcher that runs straight over the text of a string
+** input. Character sets become 256 entry tables, and the rest keeps the
+** shape and meaning of the parser: choices are tried in order, repetition
+** is greedy and never gives characters back, and lookahead consumes
+** nothing. The output of every node is the text it consumed, so a match
+** is copied out once as a single span instead of being built from a
+** string per character folded together with mpcf_strfold.
+**
+** A failed match leaves no error behind. When the whole parse fails,
+** mpc_parse_input runs it again on the parser trees, so errors read the
+** same as they always have.
+*/
+
+enum {
+  MPC_MATCH_SET,
+  MPC_MATCH_SEQ,
+  MPC_MATCH_ALT,
+  MPC_MATCH_REPEAT,
+  MPC_MATCH_NOT,
+  MPC_MATCH_ANCHOR,
+  MPC_MATCH_SOI,
+  MPC_MATCH_EOI
+};
+
+struct mpc_match_t {
+  int type;
+  int n;
+  mpc_match_t **xs;
+  int min, max;              /* repeat counts, max is -1 for no limit */
+  char *set;                 /* indexed by unsigned char */
+  int (*anchor)(char,char);
+};
+
+typedef struct {
+  const char *string;
+  size_t length;
+  size_t start;
+  char last;
+} mpc_match_input_t;
+
+static mpc_match_t *mpc_match_new(int type, int n) {
+  mpc_match_t *m = calloc(1, sizeof(mpc_match_t));
+  m->type = type;
+  m->n = n;
+  m->xs = n > 0 ? calloc(n, sizeof(mpc_match_t*)) : NULL;
+  m->max = -1;
+  return m;
+}
+
+static void mpc_match_delete(mpc_match_t *m) {
+  int j;
+  if (m == NULL) { return; }
+  for (j = 0; j < m->n; j++) { mpc_match_delete(m->xs[j]); }
+  free(m->xs);
+  free(m->set);
+  free(m);
+}
+
+static mpc_match_t *mpc_match_set(mpc_parser_t *p) {
+
+  int c;
+  char x;
+  mpc_match_t *m = mpc_match_new(MPC_MATCH_SET, 0);
+  m->set = calloc(256, 1);
+
+  /* each character is tested as the parser tests it, and '\0' is the end */
+  for (c = 1; c < 256; c++) {
+    x = (char)c;
+    switch (p->type) {
+      case MPC_TYPE_ANY:     m->set[c] = 1; break;
+      case MPC_TYPE_SINGLE:  m->set[c] = x == p->data.single.x; break;
+      case MPC_TYPE_RANGE:   m->set[c] = x >= p->data.range.x && x <= p->data.range.y; break;
+      case MPC_TYPE_ONEOF:   m->set[c] = strchr(p->data.string.x, x) != 0; break;
+      case MPC_TYPE_NONEOF:  m->set[c] = strchr(p->data.string.x, x) == 0; break;
+      case MPC_TYPE_SATISFY: m->set[c] = p->data.satisfy.f(x) != 0; break;
+    }
+  }
+
+  return m;
+}
+
+static int mpc_match_empty(mpc_match_t *m) {
+  int j;
+  switch (m->type) {
+    case MPC_MATCH_SET: return 0;
+    case MPC_MATCH_SEQ:
+    case MPC_MATCH_ALT:
+    case MPC_MATCH_REPEAT:
+      for (j = 0; j < m->n; j++) {
+        if (!mpc_match_empty(m->xs[j])) { return 0; }
+      }
+      return 1;
+    default: return 1;
+  }
+}
+
+static mpc_match_t *mpc_match_compile(mpc_parser_t *p);
+
+static mpc_match_t *mpc_match_children(int type, int n, mpc_parser_t **xs) {
+  int j;
+  mpc_match_t *m = mpc_match_new(type, n);
+  for (j = 0; j < n; j++) {
+    m->xs[j] = mpc_match_compile(xs[j]);
+    if (m->xs[j] == NULL) { mpc_match_delete(m); return NULL; }
+  }
+  return m;
+}
+
+static mpc_match_t *mpc_match_repeat(mpc_parser_t *x, int min, int max) {
+  mpc_match_t *m = mpc_match_children(MPC_MATCH_REPEAT, 1, &x);
+  if (m) { m->min = min; m->max = max; }
+  return m;
+}
+
+/* fst and snd keep one output, so the others must consume nothing */
+static mpc_match_t *mpc_match_pick(mpc_parser_t *p, int keep) {
+  int j;
+  mpc_match_t *m = mpc_match_children(MPC_MATCH_SEQ, p->data.and.n, p->data.and.xs);
+  if (m == NULL) { return NULL; }
+  for (j = 0; j < m->n; j++) {
+    if (j != keep && !mpc_match_empty(m->xs[j])) { mpc_match_delete(m); return NULL; }
+  }
+  return m;
+}
+
+/*
+** Returns NULL for parsers the matcher can't run exactly as they run,
+** such as a count, which doesn't rewind what it consumed when it fails.
+*/
+static mpc_match_t *mpc_match_compile(mpc_parser_t *p) {
+
+  int j;
+  mpc_match_t *m;
+
+  if (p->retained) { return NULL; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_SATISFY:
+      return mpc_match_set(p);
+
+    case MPC_TYPE_STRING:
+      m = mpc_match_new(MPC_MATCH_SEQ, strlen(p->data.string.x));
+      for (j = 0; j < m->n; j++) {
+        m->xs[j] = mpc_match_new(MPC_MATCH_SET, 0);
+        m->xs[j]->set = calloc(256, 1);
+        m->xs[j]->set[(unsigned char)p->data.string.x[j]] = 1;
+      }
+      return m;
+
+    case MPC_TYPE_ANCHOR:
+      m = mpc_match_new(MPC_MATCH_ANCHOR, 0);
+      m->anchor = p->data.anchor.f;
+      return m;
+
+    case MPC_TYPE_SOI: return mpc_match_new(MPC_MATCH_SOI, 0);
+    case MPC_TYPE_EOI: return mpc_match_new(MPC_MATCH_EOI, 0);
+
+    case MPC_TYPE_EXPECT: return mpc_match_compile(p->data.expect.x);
+
+    case MPC_TYPE_LIFT:
+      if (p->data.lift.lf != mpcf_ctor_str) { return NULL; }
+      return mpc_match_new(MPC_MATCH_SEQ, 0);
+
+    case MPC_TYPE_NOT:
+      if (p->data.not.lf != mpcf_ctor_str) { return NULL; }
+      return mpc_match_children(MPC_MATCH_NOT, 1, &p->data.not.x);
+
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return NULL; }
+      return mpc_match_repeat(p->data.not.x, 0, 1);
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      if (p->data.repeat.f != mpcf_strfold) { return NULL; }
+      return mpc_match_repeat(p->data.repeat.x, p->type == MPC_TYPE_MANY1, -1);
+
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { return NULL; }
+      return mpc_match_children(MPC_MATCH_ALT, p->data.or.n, p->data.or.xs);
+
+    case MPC_TYPE_AND:
+      if (p->data.and.n == 0) { return NULL; }
+      if (p->data.and.f == mpcf_strfold) {
+        return mpc_match_children(MPC_MATCH_SEQ, p->data.and.n, p->data.and.xs);
+      }
+      if (p->data.and.f == mpcf_fst) { return mpc_match_pick(p, 0); }
+      if (p->data.and.f == mpcf_snd) { return mpc_match_pick(p, 1); }
+      return NULL;
+
+    default: return NULL;
+  }
+}
+
+static char mpc_match_peek(mpc_match_input_t *in, size_t pos) {
+  return pos < in->length ? in->string[pos] : '\0';
+}
+
+static char mpc_match_last(mpc_match_input_t *in, size_t pos) {
+  return pos > in->start ? in->string[pos-1] : in->last;
+}
+
+/* Matches m at *pos, leaving *pos and *term as they were if it fails */
+static int mpc_match_run(mpc_match_input_t *in, mpc_match_t *m, size_t *pos, int *term) {
+
+  int j = 0;
+  size_t start = *pos;
+  int start_term = *term;
+  const unsigned char *s = (const unsigned char*)in->string;
+  const char *set;
+
+  switch (m->type) {
+
+    case MPC_MATCH_SET:
+      if (*pos < in->length && m->set[s[*pos]]) { (*pos)++; return 1; }
+      return 0;
+
+    case MPC_MATCH_SEQ:
+      for (j = 0; j < m->n; j++) {
+        if (!mpc_match_run(in, m->xs[j], pos, term)) {
+          *pos = start;
+          *term = start_term;
+          return 0;
+        }
+      }
+      return 1;
+
+    case MPC_MATCH_ALT:
+      for (j = 0; j < m->n; j++) {
+        if (mpc_match_run(in, m->xs[j], pos, term)) { return 1; }
+      }
+      return 0;
+
+    case MPC_MATCH_REPEAT:
+
+      /* a run of characters from one set is the common case */
+      if (m->xs[0]->type == MPC_MATCH_SET) {
+        set = m->xs[0]->set;
+        while ((m->max < 0 || j < m->max)
+        &&     *pos < in->length && set[s[*pos]]) {
+          (*pos)++;
+          j++;
+        }
+        return j >= m->min;
+      }
+
+      while (m->max < 0 || j < m->max) {
+        start = *pos;
+        if (!mpc_match_run(in, m->xs[0], pos, term)) { break; }
+        j++;
+        /* the parser would repeat an empty match forever */
+        if (*pos == start) { break; }
+      }
+      return j >= m->min;
+
+    case MPC_MATCH_NOT:
+      if (mpc_match_run(in, m->xs[0], pos, term)) {
+        *pos = start;
+        *term = start_term;
+        return 0;
+      }
+      return 1;
+
+    case MPC_MATCH_ANCHOR:
+      return m->anchor(mpc_match_last(in, *pos), mpc_match_peek(in, *pos));
+
+    case MPC_MATCH_SOI:
+      return mpc_match_last(in, *pos) == '\0';
+
+    case MPC_MATCH_EOI:
+      if (*term || mpc_match_peek(in, *pos) != '\0') { return 0; }
+      *term = 1;
+      return 1;
+
+    default: return 0;
+  }
+}
+
+static int mpc_input_match(mpc_input_t *i, mpc_match_t *m, char **o) {
+
+  mpc_match_input_t in;
+  size_t pos = i->state.pos;
+  int term = i->state.term;
+  size_t j, n;
+
+  in.string = i->string;
+  in.length = i->length;
+  in.start = pos;
+  in.last = i->last;
+
+  i->regexes = 1;
+  if (!mpc_match_run(&in, m, &pos, &term)) { return 0; }
+
+  for (j = in.start; j < pos; j++) {
+    i->state.col++;
+    if (i->string[j] == '\n') {
+      i->state.col = 0;
+      i->state.row++;
+    }
+  }
+
+  n = pos - in.start;
+  if (n > 0) { i->last = i->string[pos-1]; }
+  i->state.pos = (long)pos;
+  i->state.term = term;
+
+  *o = mpc_malloc(i, n + 1);
+  memcpy(*o, i->string + in.start, n);
+  (*o)[n] = '\0';
+  return 1;
+}
+
+/*
+** Packrat Parsing
+**
+** A parser wrapped with mpc_packrat remembers what happened each time it
+** ran on a string input, keyed on the position and on the input flags
+** that change what it does. Running it at the same place again replays
+** that result. The input jumps to where the first run ended, the output
+** is copied with the given copy function, and the errors merged during
+** the first run are merged again. When every rule of a grammar is wrapped,
+** as MPCA_LANG_PACKRAT does, each rule runs at most once per position, so
+** backtracking can't make a parse worse than linear.
+*/
+
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+
+  int j;
+  mpc_err_t *y;
+
+  if (x == NULL) { return NULL; }
+
+  y = malloc(sizeof(mpc_err_t));
+  memcpy(y, x, sizeof(mpc_err_t));
+
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+
+  y->expected = malloc(sizeof(char*) * x->expected_num);
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = malloc(strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+  }
+
+  return y;
+}
+
+static int mpc_memo_flags(mpc_input_t *i) {
+  return (i->suppress > 0) | (i->backtrack < 1) << 1 | (i->state.term != 0) << 2;
+}
+
+/* The table slot for p at pos, which is 0 if it hasn't run there */
+static size_t *mpc_memo_slot(mpc_input_t *i, mpc_parser_t *p, long pos, int flags) {
+
+  size_t mask = i->memo_slots - 1;
+  size_t j = (size_t)p * 31 + (size_t)pos * 2654435761u + (size_t)flags;
+  mpc_memo_t *m;
+
+  j ^= j >> 15;
+  j *= 2246822519u;
+  j ^= j >> 13;
+
+  for (j &= mask;; j = (j + 1) & mask) {
+    if (i->memo_table[j] == 0) { return &i->memo_table[j]; }
+    m = &i->memo[i->memo_table[j] - 1];
+    if (m->p == p && m->pos == pos && m->flags == flags) { return &i->memo_table[j]; }
+  }
+}
+
+static void mpc_memo_grow(mpc_input_t *i) {
+
+  size_t j;
+  mpc_memo_t *m;
+
+  free(i->memo_table);
+  i->memo_slots = i->memo_slots ? i->memo_slots * 2 : 256;
+  i->memo_table = calloc(i->memo_slots, sizeof(size_t));
+
+  for (j = 0; j < i->memo_num; j++) {
+    m = &i->memo[j];
+    *mpc_memo_slot(i, m->p, m->pos, m->flags) = j + 1;
+  }
+}
+
+static void mpc_input_memo_clear(mpc_input_t *i) {
+
+  size_t j;
+  mpc_memo_t *m;
+
+  for (j = 0; j < i->memo_num; j++) {
+    m = &i->memo[j];
+    if (m->output) { m->p->data.packrat.dtor(m->output); }
+    if (m->error)  { mpc_err_delete(m->error); }
+    if (m->errors) { mpc_err_delete(m->errors); }
+  }
+
+  free(i->memo);
+  free(i->memo_table);
+  i->memo = NULL;
+  i->memo_num = 0;
+  i->memo_cap = 0;
+  i->memo_table = NULL;
+  i->memo_slots = 0;
+}
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth);
+
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+
+  mpc_pdata_packrat_t *d = &p->data.packrat;
+  long pos = i->state.pos;
+  int flags = mpc_memo_flags(i);
+  mpc_err_t *errors = NULL;
+  size_t *slot;
+  mpc_memo_t *m;
+  int x;
+
+  d->lookups++;
+
+  slot = i->memo_slots ? mpc_memo_slot(i, p, pos, flags) : NULL;
+  if (slot && *slot) {
+    m = &i->memo[*slot - 1];
+    d->hits++;
+    i->state = m->state;
+    i->last = m->last;
+    *e = mpc_err_merge(i, *e, mpc_err_copy(m->errors));
+    if (m->ok) {
+      r->output = m->output ? d->copy(m->output) : NULL;
+    } else {
+      r->error = mpc_err_copy(m->error);
+    }
+    return m->ok;
+  }
+
+  /* errors are gathered apart from e, so a replay can merge the same ones */
+  x = mpc_parse_run(i, d->x, r, &errors, depth+1);
+
+  if (i->memo_num == i->memo_cap) {
+    i->memo_cap = i->memo_cap ? i->memo_cap * 2 : 64;
+    i->memo = realloc(i->memo, sizeof(mpc_memo_t) * i->memo_cap);
+  }
+  if ((i->memo_num + 1) * 2 > i->memo_slots) { mpc_memo_grow(i); }
+
+  slot = mpc_memo_slot(i, p, pos, flags);
+  *slot = i->memo_num + 1;
+  m = &i->memo[i->memo_num++];
+  m->p = p;
+  m->pos = pos;
+  m->flags = flags;
+  m->ok = x;
+  m->state = i->state;
+  m->last = i->last;
+  m->output = NULL;
+  m->error = NULL;
+  m->errors = mpc_err_copy(errors);
+
+  if (x) {
+    r->output = mpc_export(i, r->output);
+    if (r->output) { m->output = d->copy(r->output); }
+  } else {
+    m->error = mpc_err_copy(r->error);
+  }
+
+  *e = mpc_err_merge(i, *e, errors);
+  return x;
+}
+
 enum {
   MPC_PARSE_STACK_MIN = 4
 };
@@ -1074,6 +1685,21 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
     case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
 
+    /* Compiled Regexes */
+
+    case MPC_TYPE_REGEX:
+      if (p->data.regex.m == NULL || i->type != MPC_INPUT_STRING
+      ||  i->backtrack < 1 || i->regexes < 0) {
+        return mpc_parse_run(i, p->data.regex.x, r, e, depth+1);
+      }
+      MPC_PRIMITIVE(mpc_input_match(i, p->data.regex.m, (char**)&r->output));
+
+    case MPC_TYPE_PACKRAT:
+      if (i->type != MPC_INPUT_STRING) {
+        return mpc_parse_run(i, p->data.packrat.x, r, e, depth+1);
+      }
+      return mpc_parse_memo(i, p, r, e, depth);
+
     /* Other parsers */
 
     case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
@@ -1309,9 +1935,22 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
+  mpc_state_t state = i->state;
+  char last = i->last;
   mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
   x = mpc_parse_run(i, p, r, &e, 0);
+  if (!x && i->regexes > 0) {
+    /* compiled regexes fail without errors, so find them with the trees */
+    mpc_err_delete_internal(i, mpc_err_merge(i, e, r->error));
+    mpc_input_memo_clear(i);
+    i->state = state;
+    i->last = last;
+    i->regexes = -1;
+    e = mpc_err_fail(i, "Unknown Error");
+    e->state = mpc_state_invalid();
+    x = mpc_parse_run(i, p, r, &e, 0);
+  }
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
@@ -1339,8 +1978,11 @@ int mpc_nparse(const char *filename, const char *string, size_t length, mpc_pars
 
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
+  long start = ftell(file);
   mpc_input_t *i = mpc_input_new_file(filename, file);
   x = mpc_parse_input(i, p, r);
+  /* leave the file just after the input that was used */
+  if (start >= 0) { fseek(file, start + i->state.pos, SEEK_SET); }
   mpc_input_delete(i);
   return x;
 }
@@ -1433,6 +2075,13 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
     case MPC_TYPE_AND: mpc_undefine_and(p); break;
 
+    case MPC_TYPE_REGEX:
+      mpc_undefine_unretained(p->data.regex.x, 0);
+      mpc_match_delete(p->data.regex.m);
+      break;
+
+    case MPC_TYPE_PACKRAT: mpc_undefine_unretained(p->data.packrat.x, 0); break;
+
     case MPC_TYPE_CHECK:
       mpc_undefine_unretained(p->data.check.x, 0);
       free(p->data.check.e);
@@ -1567,6 +2216,17 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       strcpy(p->data.check_with.e, a->data.check_with.e);
       break;
 
+    case MPC_TYPE_REGEX:
+      p->data.regex.x = mpc_copy(a->data.regex.x);
+      p->data.regex.m = mpc_match_compile(p->data.regex.x);
+      break;
+
+    case MPC_TYPE_PACKRAT:
+      p->data.packrat.x = mpc_copy(a->data.packrat.x);
+      p->data.packrat.lookups = 0;
+      p->data.packrat.hits = 0;
+      break;
+
     default: break;
   }
 
@@ -1883,6 +2543,23 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_packrat(mpc_parser_t *a, mpc_copy_t c, mpc_dtor_t d) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PACKRAT;
+  p->data.packrat.x = a;
+  p->data.packrat.copy = c;
+  p->data.packrat.dtor = d;
+  p->data.packrat.lookups = 0;
+  p->data.packrat.hits = 0;
+  return p;
+}
+
+void mpc_packrat_stats(mpc_parser_t *p, long *lookups, long *hits) {
+  int packrat = p->type == MPC_TYPE_PACKRAT;
+  *lookups = packrat ? p->data.packrat.lookups : 0;
+  *hits = packrat ? p->data.packrat.hits : 0;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -2359,6 +3036,15 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
+/* Wraps the parser built for a regex with its compiled matcher */
+static mpc_parser_t *mpc_regex(mpc_parser_t *x) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_REGEX;
+  p->data.regex.x = x;
+  p->data.regex.m = mpc_match_compile(x);
+  return p;
+}
+
 mpc_parser_t *mpc_re(const char *re) {
   return mpc_re_mode(re, MPC_RE_DEFAULT);
 }
@@ -2426,7 +3112,7 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode) {
 
   mpc_optimise(r.output);
 
-  return r.output;
+  return mpc_regex(r.output);
 
 }
 
@@ -2759,6 +3445,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_PACKRAT)  { mpc_print_unretained(p->data.packrat.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2767,6 +3454,8 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
   if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
 
+  if (p->type == MPC_TYPE_REGEX) { mpc_print_unretained(p->data.regex.x, 0); }
+
   if (p->type == MPC_TYPE_OR) {
     printf("(");
     for(i = 0; i < p->data.or.n-1; i++) {
@@ -2873,6 +3562,22 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 ** AST
 */
 
+static mpc_val_t *mpcf_ast_copy(mpc_val_t *x) {
+
+  int i;
+  mpc_ast_t *a = x;
+  mpc_ast_t *b = mpc_ast_new(a->tag, a->contents);
+
+  b->state = a->state;
+  b->children_num = a->children_num;
+  b->children = malloc(sizeof(mpc_ast_t*) * a->children_num);
+  for (i = 0; i < a->children_num; i++) {
+    b->children[i] = mpcf_ast_copy(a->children[i]);
+  }
+
+  return b;
+}
+
 void mpc_ast_delete(mpc_ast_t *a) {
 
   int i;
@@ -3651,6 +4356,9 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (st->flags & MPCA_LANG_PACKRAT) {
+      stmt->grammar = mpc_packrat(stmt->grammar, mpcf_ast_copy, (mpc_dtor_t)mpc_ast_delete);
+    }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
@@ -3845,6 +4553,7 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_PACKRAT)  { return 1 + mpc_nodecount_unretained(p->data.packrat.x, 0); }
 
   if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
@@ -3856,6 +4565,8 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
   if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
 
+  if (p->type == MPC_TYPE_REGEX) { return 1 + mpc_nodecount_unretained(p->data.regex.x, 0); }
+
   if (p->type == MPC_TYPE_OR) {
     total = 1;
     for(i = 0; i < p->data.or.n; i++) {
@@ -3880,6 +4591,9 @@ void mpc_stats(mpc_parser_t* p) {
   printf("Stats\n");
   printf("=====\n");
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+  if (p->type == MPC_TYPE_PACKRAT) {
+    printf("Packrat Hits: %li of %li\n", p->data.packrat.hits, p->data.packrat.lookups);
+  }
 }
 
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
@@ -3897,11 +4611,13 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_PACKRAT)    { mpc_optimise_unretained(p->data.packrat.x, 0); }
   if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
   if (p->type == MPC_TYPE_MANY1)      { mpc_optimise_unretained(p->data.repeat.x, 0); }
   if (p->type == MPC_TYPE_COUNT)      { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_REGEX)      { mpc_optimise_unretained(p->data.regex.x, 0); }
 
   if (p->type == MPC_TYPE_OR) {
     for(i = 0; i < p->data.or.n; i++) {
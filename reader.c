@@ -0,0 +1,463 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "lisp.h"
+#include "mpc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * Reader for the Lispy grammar.
+ *
+ * It reads the same language as the mpc grammar below, and builds
+ * lvals straight from the source text in one pass. The grammar needs one
+ * character of lookahead. A number is -?[0-9]+ and is tried before a
+ * symbol, so `-1x` reads as -1 followed by x, just as it does with mpc.
+ * Comments are skipped. Errors report the row and column they were found
+ * at, as "file:row:col: error: ...".
+ *
+ * `--reader=mpc` switches back to the mpc grammar, and `--packrat` makes
+ * it memoize the expr rule.
+ */
+int lisp_reader = LREADER_DIRECT;
+int lisp_packrat;
+
+typedef struct lreader {
+    char *filename;
+    char *src;
+    char *p;
+    lval *err;
+} lreader;
+
+static int lread_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' ||
+           c == '\v';
+}
+
+static int lread_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static int lread_symchar(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           lread_digit(c) || (c != '\0' && strchr("_+-*/\\=<>!&", c));
+}
+
+/* Records "expected what" at r->p, unless an error was already found */
+static lval *lread_error(lreader *r, char *what)
+{
+    long row = 1;
+    long col = 1;
+    char at[16];
+
+    if (r->err) {
+        return NULL;
+    }
+
+    for (char *s = r->src; s < r->p; s++) {
+        if (*s == '\n') {
+            row++;
+            col = 1;
+        } else {
+            col++;
+        }
+    }
+
+    if (*r->p == '\0') {
+        strcpy(at, "end of input");
+    } else if (*r->p == '\n') {
+        strcpy(at, "newline");
+    } else {
+        snprintf(at, sizeof(at), "'%c'", *r->p);
+    }
+
+    r->err = lval_err("%s:%ld:%ld: error: expected %s at %s", r->filename,
+                      row, col, what, at);
+
+    return NULL;
+}
+
+/* Skips whitespace and comments */
+static void lread_skip(lreader *r)
+{
+    for (;;) {
+        while (lread_space(*r->p)) {
+            r->p++;
+        }
+        if (*r->p != ';') {
+            return;
+        }
+        while (*r->p && *r->p != '\n' && *r->p != '\r') {
+            r->p++;
+        }
+    }
+}
+
+static lval *lread_expr(lreader *r);
+
+/* Reads cells into v until close, which is consumed */
+static lval *lread_cells(lreader *r, lval *v, char close)
+{
+    char expected[4] = {'\'', close, '\'', '\0'};
+
+    for (;;) {
+        lval *x;
+
+        lread_skip(r);
+        if (*r->p == close) {
+            r->p++;
+            return v;
+        }
+        if (*r->p == '\0' || *r->p == ')' || *r->p == '}') {
+            lval_delete(v);
+            return lread_error(r, expected);
+        }
+
+        x = lread_expr(r);
+        if (!x) {
+            lval_delete(v);
+            return NULL;
+        }
+        v = lval_add(v, x);
+    }
+}
+
+static lval *lread_string(lreader *r)
+{
+    char *start = ++r->p;
+    char *raw;
+    lval *v;
+
+    while (*r->p != '"') {
+        if (*r->p == '\0' || (*r->p == '\\' && r->p[1] == '\0')) {
+            r->p += *r->p != '\0';
+            return lread_error(r, "'\"'");
+        }
+        r->p += *r->p == '\\' ? 2 : 1;
+    }
+
+    raw = malloc((size_t)(r->p - start) + 1);
+    memcpy(raw, start, (size_t)(r->p - start));
+    raw[r->p - start] = '\0';
+    r->p++;
+
+    raw = mpcf_unescape(raw);
+    v = lval_str(raw);
+    free(raw);
+
+    return v;
+}
+
+static lval *lread_symbol(lreader *r)
+{
+    char buf[64];
+    char *start = r->p;
+    size_t n;
+    char *s;
+    lval *v;
+
+    while (lread_symchar(*r->p)) {
+        r->p++;
+    }
+
+    n = (size_t)(r->p - start);
+    s = n < sizeof(buf) ? buf : malloc(n + 1);
+    memcpy(s, start, n);
+    s[n] = '\0';
+
+    v = lval_sym(s);
+    if (s != buf) {
+        free(s);
+    }
+
+    return v;
+}
+
+/* Reads one expression at r->p, which is past any whitespace */
+static lval *lread_expr(lreader *r)
+{
+    char c = *r->p;
+    long x;
+
+    if (lread_digit(c) || (c == '-' && lread_digit(r->p[1]))) {
+        /* strtol stops where the regex would */
+        x = strtol(r->p, &r->p, 10);
+        return lval_num(x);
+    }
+
+    if (lread_symchar(c)) {
+        return lread_symbol(r);
+    }
+
+    switch (c) {
+    case '(':
+        r->p++;
+        return lread_cells(r, lval_sexpr(), ')');
+    case '{':
+        r->p++;
+        return lread_cells(r, lval_qexpr(), '}');
+    case '"':
+        return lread_string(r);
+    }
+
+    return lread_error(r, "expression");
+}
+
+/*
+ * Reads every expression in src into an S-expression, or returns an
+ * error naming where the text stopped making sense.
+ */
+lval *lread(char *filename, char *src)
+{
+    lreader r = {filename, src, src, NULL};
+    lval *v = lval_sexpr();
+
+    for (;;) {
+        lval *x;
+
+        lread_skip(&r);
+        if (*r.p == '\0') {
+            return v;
+        }
+
+        x = lread_expr(&r);
+        if (!x) {
+            lval_delete(v);
+            return r.err;
+        }
+        v = lval_add(v, x);
+    }
+}
+
+/* The contents of the file at path, NUL-terminated, or NULL */
+char *lread_file(char *path, size_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    struct stat st;
+    char *buf = NULL;
+
+    if (!f) {
+        return NULL;
+    }
+
+    /* a directory opens, but has no size to read it by */
+    if (fstat(fileno(f), &st) == 0 && !S_ISDIR(st.st_mode)) {
+        buf = mpc_read_file(f, len);
+    }
+    fclose(f);
+
+    return buf;
+}
+
+/*
+ * The mpc grammar, for `--reader=mpc`: the same as lread's, with the
+ * tokens matched by the regexes below, whitespace allowed between them,
+ * and the expressions tried in the order number, symbol, sexpr, qexpr,
+ * string, comment.
+ *
+ * It is built from combinators whose folds make lvals as they match, so
+ * no mpc_ast_t is ever built. Comments fold to NULL and lists skip them.
+ */
+#define LREAD_NUMBER_RE "-?[0-9]+"
+#define LREAD_SYMBOL_RE "[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+"
+#define LREAD_STRING_RE "\"(\\\\.|[^\"])*\""
+#define LREAD_COMMENT_RE ";[^\\r\\n]*"
+
+static mpc_parser_t *lread_expr_p;
+static mpc_parser_t *lread_lispy_p;
+
+static mpc_val_t *lread_fold_num(mpc_val_t *x)
+{
+    lval *v = lval_num(strtol(x, NULL, 10));
+
+    free(x);
+    return v;
+}
+
+static mpc_val_t *lread_fold_sym(mpc_val_t *x)
+{
+    lval *v = lval_sym(x);
+
+    free(x);
+    return v;
+}
+
+static mpc_val_t *lread_fold_str(mpc_val_t *x)
+{
+    char *s = x;
+    lval *v;
+
+    /* drop the quotes */
+    s[strlen(s) - 1] = '\0';
+    memmove(s, s + 1, strlen(s));
+
+    s = mpcf_unescape(s);
+    v = lval_str(s);
+    free(s);
+
+    return v;
+}
+
+static mpc_val_t *lread_fold_cells(int n, mpc_val_t **xs)
+{
+    lval *v = lval_sexpr();
+
+    for (int i = 0; i < n; i++) {
+        if (xs[i]) {
+            v = lval_add(v, xs[i]);
+        }
+    }
+
+    return v;
+}
+
+/* '(' cells ')' or '{' cells '}' */
+static mpc_val_t *lread_fold_list(int n, mpc_val_t **xs)
+{
+    lval *v = xs[1];
+
+    (void)n;
+    if (*(char *)xs[0] == '{') {
+        v->type = LVAL_QEXPR;
+    }
+    free(xs[0]);
+    free(xs[2]);
+
+    return v;
+}
+
+static void lread_dtor(mpc_val_t *x)
+{
+    if (x) {
+        lval_delete(x);
+    }
+}
+
+/* memoized exprs are shared, not copied */
+static mpc_val_t *lread_copy(mpc_val_t *x)
+{
+    return lval_retain(x);
+}
+
+static mpc_parser_t *lread_list(char open, char close)
+{
+    return mpc_and(3, lread_fold_list, mpc_tok(mpc_char(open)),
+                   mpc_many(lread_fold_cells, lread_expr_p),
+                   mpc_tok(mpc_char(close)), free, lread_dtor);
+}
+
+static mpc_parser_t *lread_token(char *re, mpc_apply_t f)
+{
+    return mpc_apply(mpc_tok(mpc_re(re)), f);
+}
+
+static void lread_mpc_init(void)
+{
+    mpc_parser_t *expr;
+
+    lread_expr_p = mpc_new("expr");
+    lread_lispy_p = mpc_new("lispy");
+
+    expr = mpc_or(6, lread_token(LREAD_NUMBER_RE, lread_fold_num),
+                  lread_token(LREAD_SYMBOL_RE, lread_fold_sym),
+                  lread_list('(', ')'), lread_list('{', '}'),
+                  lread_token(LREAD_STRING_RE, lread_fold_str),
+                  lread_token(LREAD_COMMENT_RE, mpcf_free));
+    if (lisp_packrat) {
+        expr = mpc_packrat(expr, lread_copy, lread_dtor);
+    }
+    mpc_define(lread_expr_p, expr);
+
+    mpc_define(lread_lispy_p,
+               mpc_total(mpc_many(lread_fold_cells, lread_expr_p),
+                         lread_dtor));
+}
+
+/* Reads src with mpc, the same way as lread */
+lval *lread_mpc(char *filename, char *src)
+{
+    mpc_result_t r;
+    long lookups;
+    long hits;
+    lval *v;
+    int ok;
+
+    if (!lread_lispy_p) {
+        lread_mpc_init();
+    }
+
+    ok = mpc_parse(filename, src, lread_lispy_p, &r);
+
+    mpc_packrat_stats(lread_expr_p, &lookups, &hits);
+    lisp_stats.packrat_lookups = (size_t)lookups;
+    lisp_stats.packrat_hits = (size_t)hits;
+
+    if (!ok) {
+        char *msg = mpc_err_string(r.error);
+
+        /* mpc ends its messages with a newline */
+        msg[strcspn(msg, "\n")] = '\0';
+        v = lval_err("%s", msg);
+
+        mpc_err_delete(r.error);
+        free(msg);
+
+        return v;
+    }
+
+    return r.output;
+}
+
+void lread_cleanup(void)
+{
+    if (lread_lispy_p) {
+        mpc_cleanup(2, lread_expr_p, lread_lispy_p);
+        lread_expr_p = NULL;
+        lread_lispy_p = NULL;
+    }
+}
+
+/* Seconds per read of src with read, over at least a quarter second */
+static double lread_time(lval *(*read)(char *, char *), char *path,
+                         char *src)
+{
+    clock_t start = clock();
+    clock_t now;
+    size_t runs = 0;
+
+    do {
+        lval_delete(read(path, src));
+        runs++;
+        now = clock();
+    } while (now - start < CLOCKS_PER_SEC / 4);
+
+    return (double)(now - start) / CLOCKS_PER_SEC / (double)runs;
+}
+
+/* Prints how fast both readers get through the file at path */
+void lread_bench(char *path)
+{
+    size_t len;
+    char *src = lread_file(path, &len);
+    double direct;
+    double mpc;
+
+    if (!src) {
+        fprintf(stderr, "%s: can't read\n", path);
+        return;
+    }
+
+    direct = lread_time(lread, path, src);
+    mpc = lread_time(lread_mpc, path, src);
+
+    printf("%s: %zu bytes, direct %.1f MB/s, mpc %.1f MB/s (%.1fx)\n", path,
+           len, (double)len / direct / 1e6, (double)len / mpc / 1e6,
+           mpc / direct);
+
+    free(src);
+}
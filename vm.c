@@ -0,0 +1,315 @@
+#include "lisp.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Bytecode engine (`--engine=vm`).
+ *
+ * An S-expression is compiled once into a flat sequence of stack
+ * instructions, cached on the list it came from (v->code) and reused on
+ * every later evaluation of that same list. Lambda bodies, `if` branches
+ * and `eval`ed constants are shared by pointer, so each is compiled the
+ * first time it runs. Lists nobody else holds are one-shot code and are
+ * left to the tree walker.
+ *
+ * The instructions mirror lval_evaluate_sexpr exactly: cells are pushed
+ * left to right, then LVM_CALL applies the head to the rest (or returns
+ * the first error among them). The outermost call is an LVM_TAIL: a
+ * lambda body, `if` branch or `eval` argument reached through it is run
+ * by the loop in lvm_evaluate rather than by a nested lvm_run.
+ */
+enum {
+    LVM_CONST, /* push consts[arg] */
+    LVM_LOAD,  /* push the binding of symbol consts[arg] */
+    LVM_HEAD,  /* LVM_LOAD through the call-site cache, for call heads */
+    LVM_EVAL,  /* evaluate the top value again, for one-element (x) forms */
+    LVM_CALL,  /* apply the value arg + 1 slots down to the arg above it */
+    LVM_TAIL,  /* LVM_CALL that hands bodies back to lvm_evaluate */
+    LVM_RET
+};
+
+int lisp_engine = LENGINE_TREE;
+
+static lval **lvm_stack;
+static size_t lvm_sp;
+static size_t lvm_cap;
+
+static void lvm_emit(lcode *c, int op, int arg)
+{
+    c->ops = realloc(c->ops, sizeof(int) * 2 * (c->count + 1));
+    c->ops[2 * c->count] = op;
+    c->ops[2 * c->count + 1] = arg;
+    c->count++;
+}
+
+static int lvm_const(lcode *c, lval *v)
+{
+    c->consts = realloc(c->consts, sizeof(lval *) * (c->nconsts + 1));
+    c->consts[c->nconsts] = v;
+    return (int)c->nconsts++;
+}
+
+static void lvm_compile_list(lcode *c, lval *v, size_t sp);
+
+/* Compiles code leaving the value of v one slot above sp */
+static void lvm_compile_expr(lcode *c, lval *v, size_t sp)
+{
+    if (sp + 1 > c->depth) {
+        c->depth = sp + 1;
+    }
+
+    switch (LVAL_TYPE(v)) {
+    case LVAL_SYM:
+        lvm_emit(c, LVM_LOAD, lvm_const(c, lval_retain(v)));
+        break;
+    case LVAL_SEXPR:
+        lvm_compile_list(c, v, sp);
+        break;
+    default:
+        lvm_emit(c, LVM_CONST, lvm_const(c, lval_retain(v)));
+        break;
+    }
+}
+
+/* Compiles the evaluation of v's cells as an S-expression */
+static void lvm_compile_list(lcode *c, lval *v, size_t sp)
+{
+    if (v->count == 0) {
+        lvm_emit(c, LVM_CONST, lvm_const(c, lval_sexpr()));
+        return;
+    }
+
+    if (v->count > 1 && LVAL_TYPE(v->cell[0]) == LVAL_SYM) {
+        lvm_emit(c, LVM_HEAD, lvm_const(c, lval_retain(v->cell[0])));
+    } else {
+        lvm_compile_expr(c, v->cell[0], sp);
+    }
+
+    for (size_t i = 1; i < v->count; i++) {
+        lvm_compile_expr(c, v->cell[i], sp + i);
+    }
+
+    if (v->count == 1) {
+        lvm_emit(c, LVM_EVAL, 0);
+    } else {
+        lvm_emit(c, LVM_CALL, (int)(v->count - 1));
+    }
+}
+
+lcode *lcode_compile(lval *v)
+{
+    lcode *c = malloc(sizeof(lcode));
+
+    c->count = 0;
+    c->ops = NULL;
+    c->nconsts = 0;
+    c->consts = NULL;
+    c->depth = 1;
+
+    lvm_compile_list(c, v, 0);
+    if (c->ops[2 * (c->count - 1)] == LVM_CALL) {
+        c->ops[2 * (c->count - 1)] = LVM_TAIL;
+    }
+    lvm_emit(c, LVM_RET, 0);
+
+    return c;
+}
+
+void lcode_delete(lcode *c)
+{
+    for (size_t i = 0; i < c->nconsts; i++) {
+        lval_delete(c->consts[i]);
+    }
+    free(c->consts);
+    free(c->ops);
+    free(c);
+}
+
+/*
+ * Applies vals[0] to vals[1 .. count), taking ownership of all of them.
+ * When tail is given, a lambda body, `if` branch or `eval` argument is
+ * not evaluated: it is left in *tail, with the frame to run it in (or
+ * NULL for e) in *env, and NULL is returned.
+ */
+static lval *lvm_call(lenv *e, lval **vals, size_t count,
+                      lenv **env, lval **tail)
+{
+    lval *f = vals[0];
+    lval *a;
+    lval *result;
+
+    for (size_t i = 0; i < count; i++) {
+        if (LVAL_TYPE(vals[i]) == LVAL_ERR) {
+            result = lval_retain(vals[i]);
+            for (size_t j = 0; j < count; j++) {
+                lval_delete(vals[j]);
+            }
+            return result;
+        }
+    }
+
+    if (LVAL_TYPE(f) != LVAL_FUN) {
+        result = lval_err("S-Expression starts with incorrect type: "
+                          "got %s, expected %s.",
+                          ltype_name(LVAL_TYPE(f)), ltype_name(LVAL_FUN));
+        for (size_t i = 0; i < count; i++) {
+            lval_delete(vals[i]);
+        }
+        return result;
+    }
+
+    if (f->builtin && f->op != LOP_NONE && count - 1 <= LOP_ARGS_MAX) {
+        result = lval_call_op(e, f, vals + 1, count - 1);
+        lval_delete(f);
+        return result;
+    }
+
+    a = lval_sexpr();
+    for (size_t i = 1; i < count; i++) {
+        a = lval_add(a, vals[i]);
+    }
+
+    if (tail && (f->builtin == builtin_if || f->builtin == builtin_eval)) {
+        result = f->builtin == builtin_if ? lval_if_branch(a)
+                                          : lval_eval_expr(a);
+        lval_delete(f);
+        if (LVAL_TYPE(result) == LVAL_ERR) {
+            return result;
+        }
+        *env = NULL;
+        *tail = result;
+        return NULL;
+    }
+
+    if (f->builtin) {
+        result = lval_call(e, f, a);
+        lval_delete(f);
+        return result;
+    }
+
+    if (tail) {
+        result = lval_bind(e, f, a, env);
+        if (!result) {
+            *tail = lval_retain(f->body);
+        }
+    } else {
+        result = lval_call(e, f, a);
+    }
+
+    lval_delete(f);
+
+    return result;
+}
+
+/* Runs c in e. Returns the value, or NULL if c ended in a tail call */
+static lval *lvm_run(lenv *e, lcode *c, lenv **env, lval **tail)
+{
+    lval *vals[LOP_ARGS_MAX + 1];
+    lval **call;
+    lval *x;
+    size_t n;
+
+    /* nested runs may move the stack, so only indices survive a call */
+    if (lvm_sp + c->depth > lvm_cap) {
+        size_t cap = (lvm_sp + c->depth) * 2;
+        lval **stack = realloc(lvm_stack, sizeof(lval *) * cap);
+
+        if (!stack) {
+            return lval_err("Out of memory for the VM stack");
+        }
+        lvm_stack = stack;
+        lvm_cap = cap;
+    }
+
+    for (int *pc = c->ops;; pc += 2) {
+        switch (pc[0]) {
+        case LVM_CONST:
+            lvm_stack[lvm_sp++] = lval_retain(c->consts[pc[1]]);
+            break;
+        case LVM_LOAD:
+            lvm_stack[lvm_sp++] = lenv_get(e, c->consts[pc[1]]);
+            break;
+        case LVM_HEAD:
+            lvm_stack[lvm_sp++] = lenv_get_head(e, c->consts[pc[1]]);
+            break;
+        case LVM_EVAL:
+            x = lval_evaluate(e, lvm_stack[lvm_sp - 1]);
+            lvm_stack[lvm_sp - 1] = x;
+            break;
+        case LVM_CALL:
+        case LVM_TAIL:
+            n = (size_t)pc[1] + 1;
+            lvm_sp -= n;
+
+            /* move the operands off the stack before anything reenters */
+            call = n <= LOP_ARGS_MAX + 1 ? vals : malloc(sizeof(lval *) * n);
+            memcpy(call, lvm_stack + lvm_sp, sizeof(lval *) * n);
+
+            if (pc[0] == LVM_TAIL) {
+                x = lvm_call(e, call, n, env, tail);
+            } else {
+                x = lvm_call(e, call, n, NULL, NULL);
+            }
+
+            if (call != vals) {
+                free(call);
+            }
+            if (!x) {
+                return NULL;
+            }
+            lvm_stack[lvm_sp++] = x;
+            break;
+        case LVM_RET:
+            return lvm_stack[--lvm_sp];
+        }
+    }
+}
+
+/*
+ * Evaluates v in e, compiling it first if it may be evaluated again.
+ * Tail calls replace v (and e) and go round the loop, holding entered
+ * environments the same way lval_evaluate_sexpr does.
+ */
+lval *lvm_evaluate(lenv *e, lval *v)
+{
+    lframes frames = {0, 0, NULL};
+    lenv *env;
+    lval *tail;
+    lval *x;
+
+    for (;;) {
+        if (!v->code) {
+            /* nobody else can evaluate this list again, don't compile it */
+            if (v->refs == 1) {
+                v->type = LVAL_SEXPR;
+                x = lval_evaluate(e, v);
+                break;
+            }
+            v->code = lcode_compile(v);
+        }
+
+        x = lvm_run(e, v->code, &env, &tail);
+        lval_delete(v);
+
+        if (x) {
+            break;
+        }
+
+        if (env) {
+            lframes_enter(&frames, &e, env);
+        }
+        v = tail;
+    }
+
+    lframes_release(&frames);
+
+    return x;
+}
+
+void lvm_cleanup(void)
+{
+    free(lvm_stack);
+    lvm_stack = NULL;
+    lvm_sp = 0;
+    lvm_cap = 0;
+}